@@ -7,6 +7,7 @@
 #include "RasterizerRenderer.h"
 
 #include <algorithm>
+#include <bitset>
 #include <iostream>
 
 #include "Math.h"
@@ -17,6 +18,10 @@
 #include <thread>
 #include <future>
 #include "MathHelpers.h"
+#include "ThreadPool.h"
+#include <immintrin.h>
+#include <chrono>
+#include <random>
 
 #define ASYNC
 
@@ -29,13 +34,25 @@ RasterizerRenderer::RasterizerRenderer(SDL_Window* pWindow, Camera* pCamera) :
 	m_pFrontBuffer = SDL_GetWindowSurface(pWindow);
 	m_pBackBuffer = SDL_CreateRGBSurface(0, m_Width, m_Height, 32, 0, 0, 0, 0);
 	m_pBackBufferPixels = (uint32_t*)m_pBackBuffer->pixels;
+	const SDL_PixelFormat* pFormat{ m_pBackBuffer->format };
+	m_PixelPacking = { pFormat->Rshift, pFormat->Gshift, pFormat->Bshift, pFormat->Rloss, pFormat->Gloss, pFormat->Bloss, pFormat->Amask };
 
-	m_pDepthBufferPixels = new float[m_Width * m_Height];
+	SetRenderResolution(m_Width, m_Height);
+
+	//Rounded up to whole blocks, so both layouts fit in the same buffers. Room for every MSAA sample plane is
+	//reserved up front, and any smaller render resolution needs fewer blocks, so neither ever reallocates
+	m_NrBufferPixels = m_NrBlocksX * m_NrBlocksY * m_BlockSize * m_BlockSize;
+	const int nrBufferSamples{ m_NrBufferPixels * m_MaxNrSamples };
+	m_pDepthBuffer = new uint8_t[nrBufferSamples * sizeof(float)];
+	m_ColorBuffer.resize(nrBufferSamples);
+	m_VisibilityBuffer.resize(nrBufferSamples);
+	m_pThreadPool = new ThreadPool{};
 
 	m_pTexture = TextureManager::GetTexture("Resources/vehicle_diffuse.png");
 	m_pNormalTexture = TextureManager::GetTexture("Resources/vehicle_normal.png");
 	m_pGlossTexture = TextureManager::GetTexture("Resources/vehicle_gloss.png");
 	m_pSpecularTexture = TextureManager::GetTexture("Resources/vehicle_specular.png");
+	ApplyBlockCompression();
 	Mesh* mesh{ new Mesh{} };
 	Utils::ParseOBJ("Resources/vehicle.obj", mesh->vertices, mesh->indices);
 
@@ -47,12 +64,18 @@ RasterizerRenderer::RasterizerRenderer(SDL_Window* pWindow, Camera* pCamera) :
 		{
 			OptimiseWithTriangleStrip(mesh->indices);
 		}
+		m_MeshVertexStreams.emplace_back();
+		CreateVertexStreams(mesh, m_MeshVertexStreams.back());
+		m_MeshClusters.emplace_back();
+		CreateTriangleClusters(mesh, m_MeshVertexStreams.back(), m_MeshClusters.back());
 	}
 }
 
 RasterizerRenderer::~RasterizerRenderer()
 {
-	delete[] m_pDepthBufferPixels;
+	delete m_pThreadPool;
+	delete[] m_pDepthBuffer;
+	delete m_pMaterialTexture;
 }
 
 
@@ -141,410 +164,1793 @@ void dae::RasterizerRenderer::ChangeLightning()
 	}
 }
 
-void RasterizerRenderer::Render()
+void dae::RasterizerRenderer::ToggleVisibilityBuffer()
 {
-	RenderMeshes();
+	m_UseVisibilityBuffer = !m_UseVisibilityBuffer;
+	std::cout << "**(SOFTWARE) Visibility Buffer ";
+	if (m_UseVisibilityBuffer)
+	{
+		std::cout << "ON\n";
+	}
+	else
+	{
+		std::cout << "OFF\n";
+	}
 }
 
-void RasterizerRenderer::VertexTransformationFunction(const std::vector<Mesh*>& meshes, std::vector<Vertex_Out_Rasterizer>& vertices_out) const
+void dae::RasterizerRenderer::ToggleTiledLayout()
 {
-	const float width{ static_cast<float>(m_Width) };
-	const float height{ static_cast<float>(m_Height) };
-	Matrix worldViewProjectionMatrix{};
-	auto cameraWorldView{ m_pCamera->GetWorldViewProjectionMatrix() };
-	for (const Mesh* mesh : meshes)
+	m_UseTiledLayout = !m_UseTiledLayout;
+	std::cout << "**(SOFTWARE) Framebuffer Layout ";
+	if (m_UseTiledLayout)
 	{
-		worldViewProjectionMatrix = mesh->worldMatrix * cameraWorldView;
-		for (const Vertex_In& vert : mesh->vertices)
-		{
+		std::cout << "8x8 BLOCKS\n";
+	}
+	else
+	{
+		std::cout << "LINEAR\n";
+	}
+}
 
-			auto result = worldViewProjectionMatrix.TransformPoint({ vert.position,1.f });
-			result.x /= result.w;
-			result.y /= result.w;
-			result.z /= result.w;
-			Vertex_Out_Rasterizer projected{ result };
+void dae::RasterizerRenderer::CycleDepthFormat()
+{
+	//Every block is flagged for clearing at the start of a frame, so the old contents are never read in the new format
+	int currentFormat{ static_cast<int>(m_DepthFormat) };
+	++currentFormat;
+	if (currentFormat == m_TotalDepthFormats)
+	{
+		currentFormat = 0;
+	}
+	m_DepthFormat = DepthFormat(currentFormat);
+	std::cout << "**(SOFTWARE) Depth Format = ";
+	switch (m_DepthFormat) {
+	case DepthFormat::Float32:
+		std::cout << "FLOAT32\n";
+		break;
+	case DepthFormat::Unorm24Stencil8:
+		std::cout << "UNORM24_STENCIL8\n";
+		break;
+	case DepthFormat::Unorm16:
+		std::cout << "UNORM16\n";
+		break;
+	}
+}
 
-			projected.uv = vert.uv;
-			projected.tangent = mesh->worldMatrix.TransformVector(vert.tangent);
-			projected.normal = mesh->worldMatrix.TransformVector(vert.normal).Normalized();
-			projected.color = vert.color;
-			projected.viewDirection = mesh->worldMatrix.TransformPoint(vert.position) - m_pCamera->GetOrigin();
+void dae::RasterizerRenderer::ToggleFrontToBackOrder()
+{
+	m_UseFrontToBackOrder = !m_UseFrontToBackOrder;
+	std::cout << "**(SOFTWARE) Front To Back Ordering ";
+	if (m_UseFrontToBackOrder)
+	{
+		std::cout << "ON\n";
+	}
+	else
+	{
+		std::cout << "OFF\n";
+	}
+}
 
-			vertices_out.emplace_back(projected);
-		}
+void dae::RasterizerRenderer::ToggleMsaa()
+{
+	m_UseMsaa = !m_UseMsaa;
+	std::cout << "**(SOFTWARE) MSAA ";
+	if (m_UseMsaa)
+	{
+		std::cout << "4X\n";
+	}
+	else
+	{
+		std::cout << "OFF\n";
 	}
 }
 
-void dae::RasterizerRenderer::OptimiseWithTriangleStrip(std::vector<Uint32>& indices)
+void dae::RasterizerRenderer::ToggleDynamicResolution()
 {
+	m_UseDynamicResolution = !m_UseDynamicResolution;
+	m_ResolutionScale = 1.f;
+	m_AverageFrameTime = 0.f;
+	SetRenderResolution(m_Width, m_Height);
+	std::cout << "**(SOFTWARE) Dynamic Resolution ";
+	if (m_UseDynamicResolution)
+	{
+		std::cout << "ON\n";
+	}
+	else
+	{
+		std::cout << "OFF\n";
+	}
+}
 
-	for (int i{ 1 }; i < indices.size() - 2; i += 2)
+void dae::RasterizerRenderer::TogglePipelining()
+{
+	//Whatever was set up ahead is from before the toggle, the next frame sets up its own
+	m_UsePipelining = !m_UsePipelining;
+	m_FrameSetups[0].isReady = false;
+	m_FrameSetups[1].isReady = false;
+	std::cout << "**(SOFTWARE) Frame Pipelining ";
+	if (m_UsePipelining)
 	{
-		const Uint32 indice2{ indices[i + 1] }, indice3{ indices[i + 2] };
-		indices[i + 1] = indice3;
-		indices[i + 2] = indice2;
+		std::cout << "ON\n";
+	}
+	else
+	{
+		std::cout << "OFF\n";
 	}
 }
 
-void dae::RasterizerRenderer::RenderTriangle(const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2, bool success, const SDL_Rect& boundaries)
+void dae::RasterizerRenderer::CycleTextureFilter()
 {
-	const int maxX{ boundaries.x + boundaries.w };
-	const int maxY{ boundaries.y + boundaries.h };
-	const Vector2 v0Pos{ v0.position.GetXY() };
-	const Vector2 v1Pos{ v1.position.GetXY() };
-	const Vector2 v2Pos{ v2.position.GetXY() };
-	const float cameraFar{ m_pCamera->GetFarDist() };
-	const float cameraNear{ m_pCamera->GetNearDist() };
+	int currentFilter{ static_cast<int>(m_TextureFilter) };
+	++currentFilter;
+	if (currentFilter == m_TotalTextureFilters)
+	{
+		currentFilter = 0;
+	}
+	m_TextureFilter = Texture::FilterMode(currentFilter);
+	std::cout << "**(SOFTWARE) Texture Filter = ";
+	switch (m_TextureFilter) {
+	case Texture::FilterMode::Point:
+		std::cout << "POINT\n";
+		break;
+	case Texture::FilterMode::Bilinear:
+		std::cout << "BILINEAR\n";
+		break;
+	case Texture::FilterMode::Trilinear:
+		std::cout << "TRILINEAR\n";
+		break;
+	}
+}
 
-	for (int px{ boundaries.x }; px <= maxX; ++px)
+void dae::RasterizerRenderer::ToggleTexelLayout()
+{
+	if (m_UseBlockCompression)
 	{
-		for (int py{ boundaries.y }; py <= maxY; ++py)
+		std::cout << "**(SOFTWARE) Texel Layout UNAVAILABLE, the block compressed maps are 4x4 blocks already\n";
+		return;
+	}
+	const bool useBlocks{ m_pTexture->GetTexelLayout() == Texture::TexelLayout::Linear };
+	const Texture::TexelLayout texelLayout{ useBlocks ? Texture::TexelLayout::Blocked4x4 : Texture::TexelLayout::Linear };
+	for (Texture* pTexture : { m_pTexture, m_pNormalTexture, m_pSpecularTexture, m_pGlossTexture, m_pMaterialTexture })
+	{
+		if (pTexture != nullptr)
 		{
-			Vector2 screenSpacePos{ static_cast<float>(px),static_cast<float>(py) };
-			ColorRGB finalColor{ 1.f,1.f,1.f };
-			const int currentPixel{ px + (py * m_Width) };
-
-			if (m_BoundingBoxToggled)
-			{
-				finalColor.MaxToOne();
+			pTexture->SetTexelLayout(texelLayout);
+		}
+	}
+	std::cout << "**(SOFTWARE) Texel Layout ";
+	if (useBlocks)
+	{
+		std::cout << "4x4 BLOCKS\n";
+	}
+	else
+	{
+		std::cout << "LINEAR\n";
+	}
+}
 
-				m_pBackBufferPixels[currentPixel] = SDL_MapRGB(m_pBackBuffer->format,
-					static_cast<uint8_t>(finalColor.r * 255),
-					static_cast<uint8_t>(finalColor.g * 255),
-					static_cast<uint8_t>(finalColor.b * 255));
-				continue;
-			}
+void dae::RasterizerRenderer::BenchmarkTextureSampling()
+{
+	//Random uvs land on a new cache line almost every time in any layout. The coherent walk steps one texel at a time along
+	//scanlines at an angle to the texture, like a triangle that isn't lined up with its uv axes
+	const int nrSamples{ 1 << 21 };
+	const int scanlineLength{ 512 };
+	const float texelSize{ 1.f / static_cast<float>(m_pTexture->GetWidth()) };
+	const Vector2 stepAlongLine{ Vector2{ .8f, .6f } * texelSize };
+	const Vector2 stepToNextLine{ Vector2{ -.6f, .8f } * texelSize };
+
+	std::mt19937 generator{};
+	std::uniform_real_distribution<float> distribution{ 0.f, 1.f };
+	std::vector<Vector2> randomUVs(nrSamples);
+	std::vector<Vector2> coherentUVs(nrSamples);
+	for (int sampleIndex{}; sampleIndex < nrSamples; ++sampleIndex)
+	{
+		randomUVs[sampleIndex] = Vector2{ distribution(generator), distribution(generator) };
+		const Vector2 lineStart{ Vector2{ .25f, .25f } + stepToNextLine * static_cast<float>(sampleIndex / scanlineLength) };
+		coherentUVs[sampleIndex] = lineStart + stepAlongLine * static_cast<float>(sampleIndex % scanlineLength);
+	}
 
-			Vector2 pointToSide = screenSpacePos - v0Pos;
-			Vector2 a = v1Pos - v0Pos;
-			float weight2 = Vector2::Cross(a, pointToSide);
+	//Filtered samples one texel apart read level 0, with the footprint of 4 texels instead of 1
+	const Vector2 uvDx{ stepAlongLine };
+	const Vector2 uvDy{ stepToNextLine };
+	//Keeps the compiler from dropping the sampling loops
+	volatile float sink{};
+	const auto timeSamples{ [&](const Texture* pTexture, const std::vector<Vector2>& uvs, Texture::FilterMode filterMode)
+	{
+		ColorRGB sum{};
+		const auto startTime{ std::chrono::steady_clock::now() };
+		for (const Vector2& uv : uvs)
+		{
+			sum += pTexture->Sample(uv, uvDx, uvDy, filterMode);
+		}
+		const double nrNanoseconds{ std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count() };
+		sink = sum.r + sum.g + sum.b;
+		return nrNanoseconds / static_cast<double>(uvs.size());
+	} };
 
-			pointToSide = screenSpacePos - v1Pos;
-			Vector2 b = v2Pos - v1Pos;
-			float weight0 = Vector2::Cross(b, pointToSide);
+	//Block compressed maps have no texel layout to choose, and the material texture only exists without compression
+	if (!m_UseBlockCompression)
+	{
+		const Texture::TexelLayout originalLayout{ m_pTexture->GetTexelLayout() };
+		for (const Texture::TexelLayout texelLayout : { Texture::TexelLayout::Linear, Texture::TexelLayout::Blocked4x4 })
+		{
+			m_pTexture->SetTexelLayout(texelLayout);
+			std::cout << "**(SOFTWARE) Texture::Sample (" << (texelLayout == Texture::TexelLayout::Linear ? "linear" : "4x4 blocks") << "): "
+				<< timeSamples(m_pTexture, randomUVs, Texture::FilterMode::Point) << " ns random, "
+				<< timeSamples(m_pTexture, coherentUVs, Texture::FilterMode::Point) << " ns coherent, "
+				<< timeSamples(m_pTexture, coherentUVs, Texture::FilterMode::Bilinear) << " ns coherent bilinear\n";
+		}
+		m_pTexture->SetTexelLayout(originalLayout);
+	}
 
-			pointToSide = screenSpacePos - v2Pos;
-			Vector2 c = v0Pos - v2Pos;
-			float weight1 = Vector2::Cross(c, pointToSide);
+	//Until compression is turned on the BC1 timings come from a temporary compressed copy
+	Texture* pCompressedCopy{ m_UseBlockCompression ? nullptr : Texture::CreateCompressed(m_pTexture, Texture::Compression::BC1) };
+	const Texture* pCompressedTexture{ m_UseBlockCompression ? m_pTexture : pCompressedCopy };
+	std::cout << "**(SOFTWARE) Texture::Sample (BC1): "
+		<< timeSamples(pCompressedTexture, randomUVs, Texture::FilterMode::Point) << " ns random, "
+		<< timeSamples(pCompressedTexture, coherentUVs, Texture::FilterMode::Point) << " ns coherent, "
+		<< timeSamples(pCompressedTexture, coherentUVs, Texture::FilterMode::Bilinear) << " ns coherent bilinear\n";
+	delete pCompressedCopy;
 
-			bool pointInTriangle{ };
+	if (m_pMaterialTexture == nullptr)
+	{
+		return;
+	}
 
-			switch (m_CullState)
+	//What PixelShading pays for its texture reads in the combined mode: four maps one by one, or one interleaved read
+	const Texture* pMaps[4]{ m_pTexture, m_pNormalTexture, m_pSpecularTexture, m_pGlossTexture };
+	const auto timeMaterialSamples{ [&](const std::vector<Vector2>& uvs, bool useMaterialTexture)
+	{
+		ColorRGB sum{};
+		ColorRGB materialColors[4]{};
+		const auto startTime{ std::chrono::steady_clock::now() };
+		for (const Vector2& uv : uvs)
+		{
+			if (useMaterialTexture)
 			{
-			case CullState::back:
-				pointInTriangle = (weight0 <= 0) && (weight1 <= 0) && (weight2 <= 0);
-				break;
-			case CullState::front:
-				pointInTriangle = (weight0 >= 0) && (weight1 >= 0) && (weight2 >= 0);
-				break;
-			case CullState::none:
-				pointInTriangle = ((weight0 >= 0) && (weight1 >= 0) && (weight2 >= 0)) || ((weight0 <= 0) && (weight1 <= 0) && (weight2 <= 0));
-				break;
+				m_pMaterialTexture->SampleLayers(uv, uvDx, uvDy, Texture::FilterMode::Point, materialColors);
 			}
-
-			const float totalArea{ weight0 + weight1 + weight2 };
-			weight0 /= totalArea;
-			weight1 /= totalArea;
-			weight2 /= totalArea;
-
-			if (!pointInTriangle)
+			else
 			{
-				continue;
+				for (int layer{}; layer < 4; ++layer)
+				{
+					materialColors[layer] = pMaps[layer]->Sample(uv);
+				}
 			}
+			sum += materialColors[0] + materialColors[1] + materialColors[2] + materialColors[3];
+		}
+		const double nrNanoseconds{ std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count() };
+		sink = sum.r + sum.g + sum.b;
+		return nrNanoseconds / static_cast<double>(uvs.size());
+	} };
+	for (const bool useMaterialTexture : { false, true })
+	{
+		std::cout << "**(SOFTWARE) All 4 maps (" << (useMaterialTexture ? "interleaved" : "separate") << "): "
+			<< timeMaterialSamples(randomUVs, useMaterialTexture) << " ns random, "
+			<< timeMaterialSamples(coherentUVs, useMaterialTexture) << " ns coherent\n";
+	}
+}
 
-			float lerpZ{ 1.f / ((1.f / v0.position.z) * weight0 + (1.f / v1.position.z) * weight1 + (1.f / v2.position.z) * weight2) };
-			float currentDepthValue{ m_pDepthBufferPixels[currentPixel] };
-			float lerpW{ (1.f / ((1.f / v0.position.w) * weight0 + (1.f / v1.position.w) * weight1 + (1.f / v2.position.w) * weight2)) };
-			if (lerpZ < 0 || lerpZ > 1)
-			{
-				continue;
-			}
+void dae::RasterizerRenderer::ToggleMaterialTexture()
+{
+	m_UseMaterialTexture = !m_UseMaterialTexture;
+	std::cout << "**(SOFTWARE) Interleaved Material Texture ";
+	if (m_UseMaterialTexture && m_UseBlockCompression)
+	{
+		std::cout << "UNAVAILABLE while the maps are block compressed\n";
+	}
+	else if (m_UseMaterialTexture && m_pMaterialTexture == nullptr)
+	{
+		std::cout << "UNAVAILABLE, the vehicle maps differ in size\n";
+	}
+	else if (m_UseMaterialTexture)
+	{
+		std::cout << "ON\n";
+	}
+	else
+	{
+		std::cout << "OFF\n";
+	}
+}
 
-			const bool isDepthSmaller{ currentDepthValue < lerpZ };
-			if (isDepthSmaller)
-			{
-				success = false;
-				continue;
-			}
-			m_pDepthBufferPixels[currentPixel] = lerpZ;
-			switch (m_State)
-			{
-			case RenderState::Texture:
-			{
-				const Vector2 uv{ ((v0.uv / (v0.position.w)) * weight0 + (v1.uv / v1.position.w) * weight1 + (v2.uv / v2.position.w) * weight2) * lerpW };
-				const Vector3 normal{ (((v0.normal / (v0.position.w)) * weight0 + (v1.normal / v1.position.w) * weight1 + (v2.normal / v2.position.w) * weight2) * lerpW).Normalized() };
-				const Vector3 tangent{ (((v0.tangent / (v0.position.w)) * weight0 + (v1.tangent / v1.position.w) * weight1 + (v2.tangent / v2.position.w) * weight2) * lerpW).Normalized() };
-				const Vector3 viewDir{ (((v0.viewDirection / (v0.position.w)) * weight0 + (v1.viewDirection / v1.position.w) * weight1 + (v2.viewDirection / v2.position.w) * weight2) * lerpW).Normalized() };
-				const Vector4 pos{ screenSpacePos.x,screenSpacePos.y, lerpZ, lerpW };
-				Vertex_Out_Rasterizer pixelVertex{ pos, finalColor, uv, normal, tangent, viewDir };
-				finalColor = PixelShading(pixelVertex);
-				break;
-			}
-			case RenderState::DepthBuffer:
-			{
-				Remap(lerpZ, .995f, 1.f);
-				finalColor = { lerpZ, lerpZ, lerpZ };
-				break;
-			}
-			}
+void dae::RasterizerRenderer::ToggleBlockCompression()
+{
+	m_UseBlockCompression = !m_UseBlockCompression;
+	ApplyBlockCompression();
 
-			finalColor.MaxToOne();
+	//What the software sampler keeps resident, the surfaces the DirectX views are made from come on top of this either way
+	size_t nrBytes{};
+	for (const Texture* pTexture : { m_pTexture, m_pNormalTexture, m_pSpecularTexture, m_pGlossTexture, m_pMaterialTexture })
+	{
+		if (pTexture != nullptr)
+		{
+			nrBytes += pTexture->GetNrTexelBytes();
+		}
+	}
+	const float bytesToMegabytes{ 1.f / (1024.f * 1024.f) };
+	std::cout << "**(SOFTWARE) Block Compression (BC1/BC5) ";
+	if (m_UseBlockCompression)
+	{
+		std::cout << "ON, ";
+	}
+	else
+	{
+		std::cout << "OFF, ";
+	}
+	std::cout << "the software texels of the vehicle maps take " << nrBytes * bytesToMegabytes << " MB\n";
+}
 
-			m_pBackBufferPixels[currentPixel] = SDL_MapRGB(m_pBackBuffer->format,
-				static_cast<uint8_t>(finalColor.r * 255),
-				static_cast<uint8_t>(finalColor.g * 255),
-				static_cast<uint8_t>(finalColor.b * 255));
-			success = true;
+void dae::RasterizerRenderer::ApplyBlockCompression()
+{
+	//Render is done with the textures by the time it returns, so swapping them out between frames is safe
+	const bool useCompression{ m_UseBlockCompression };
+	m_pTexture->SetCompression(useCompression ? Texture::Compression::BC1 : Texture::Compression::None);
+	m_pNormalTexture->SetCompression(useCompression ? Texture::Compression::BC5 : Texture::Compression::None);
+	m_pSpecularTexture->SetCompression(useCompression ? Texture::Compression::BC1 : Texture::Compression::None);
+	m_pGlossTexture->SetCompression(useCompression ? Texture::Compression::BC1 : Texture::Compression::None);
+
+	delete m_pMaterialTexture;
+	m_pMaterialTexture = nullptr;
+	if (!useCompression)
+	{
+		//Same order as MaterialLayer, and the same texel layout as the maps
+		m_pMaterialTexture = Texture::CreateInterleaved({ m_pTexture, m_pNormalTexture, m_pSpecularTexture, m_pGlossTexture });
+		if (m_pMaterialTexture != nullptr)
+		{
+			m_pMaterialTexture->SetTexelLayout(m_pTexture->GetTexelLayout());
 		}
 	}
 }
 
-void dae::RasterizerRenderer::RenderMeshes()
+void dae::RasterizerRenderer::PrintStatistics()
 {
-	//@START
-//Lock BackBuffer
-	SDL_LockSurface(m_pBackBuffer);
-	std::vector<Vertex_Out_Rasterizer> vertices_ndc{};
-	VertexTransformationFunction(m_MeshesWorld, vertices_ndc);
-	Uint8 colorToMap{ 100 };
+	//Forward shading runs PixelShading for every fragment that passes the depth test, the visibility buffer only for the visible ones
+	const int nrFragmentsPassed{ m_NrFragmentsPassed };
+	const int nrFragmentsShaded{ m_NrFragmentsShaded };
+	const float savedPercentage{ nrFragmentsPassed > 0 ? 100.f * static_cast<float>(nrFragmentsPassed - nrFragmentsShaded) / static_cast<float>(nrFragmentsPassed) : 0.f };
+	std::cout << "**(SOFTWARE) Triangles rasterized: " << m_NrTrianglesRasterized << ", culled or degenerate: " << m_NrTrianglesCulled << '\n';
+	std::cout << "**(SOFTWARE) Fragments passing depth: " << nrFragmentsPassed << ", shaded: " << nrFragmentsShaded << " (" << savedPercentage << "% overdraw saved)\n";
+
+	//Compare across ToggleFrontToBackOrder: the nearer the first triangles, the more of the rest gets rejected here
+	const int nrFragmentsRejected{ m_NrFragmentsRejected };
+	const int nrBlocksRejected{ m_NrBlocksRejected };
+	std::cout << "**(SOFTWARE) Fragments rejected early (" << (m_UseFrontToBackOrder ? "front to back" : "index order") << "): " << nrFragmentsRejected << " by the depth test vs " << nrFragmentsShaded << " shaded, " << nrBlocksRejected << " blocks by hierarchical Z\n";
+
+	if (m_UseDynamicResolution)
+	{
+		std::cout << "**(SOFTWARE) Render resolution: " << m_RenderWidth << 'x' << m_RenderHeight << " (" << 100.f * m_ResolutionScale << "% of the window)\n";
+	}
 
-	if (m_UniformColorToggled)
+	//Time for the whole frame up to the blit, compare it across ToggleTiledLayout
+	if (m_NrRenderedFrames > 0)
 	{
-		colorToMap = m_UniformClearColorRGBvalue;
+		std::cout << "**(SOFTWARE) Average render time (" << (m_UseTiledLayout ? "8x8 blocks" : "linear") << "): " << 1000.0 * m_TotalRenderTime / m_NrRenderedFrames << " ms\n";
 	}
+	m_TotalRenderTime = 0.0;
+	m_NrRenderedFrames = 0;
+}
 
-	SDL_FillRect(m_pBackBuffer, &m_pFrontBuffer->clip_rect, SDL_MapRGB(m_pFrontBuffer->format, colorToMap, colorToMap, colorToMap));
-	std::fill_n(m_pDepthBufferPixels, m_Width * m_Height, FLT_MAX);
+void RasterizerRenderer::Render()
+{
+	RenderMeshes();
+}
 
-	bool succes{ false };
-	for (Mesh* mesh : m_MeshesWorld)
+void RasterizerRenderer::VertexTransformationFunction(const std::vector<Mesh*>& meshes, std::vector<MeshVertexStreams>& meshVertices_out, bool isParallel) const
+{
+	const Matrix cameraWorldView{ m_pCamera->GetWorldViewProjectionMatrix() };
+	const Vector3 cameraOrigin{ m_pCamera->GetOrigin() };
+	for (size_t meshIndex{}; meshIndex < meshes.size(); ++meshIndex)
 	{
-		if (mesh->primitiveTopology == PrimitiveTopology::TriangeList)
+		const Mesh* mesh{ meshes[meshIndex] };
+		const Matrix worldMatrix{ mesh->worldMatrix };
+		const Matrix worldViewProjectionMatrix{ worldMatrix * cameraWorldView };
+		MeshVertexStreams& streams{ meshVertices_out[meshIndex] };
+
+		//Row major, a point p ends up as p.x * row0 + p.y * row1 + p.z * row2 + row3. Every element is
+		//broadcast once so 4 vertices go through the same multiply-adds side by side
+		__m128 worldViewProjection[4][4]{};
+		__m128 world[4][3]{};
+		for (int row{}; row < 4; ++row)
 		{
-			for (size_t i{}; i < mesh->indices.size(); ++i)
+			for (int column{}; column < 4; ++column)
 			{
-				Vertex_Out_Rasterizer v0{ vertices_ndc[mesh->indices[i]] };
-				Vertex_Out_Rasterizer v1{ vertices_ndc[mesh->indices[++i]] };
-				Vertex_Out_Rasterizer v2{ vertices_ndc[mesh->indices[++i]] };
-
-
-				if (v0.position.x < -1.f || v0.position.x > 1.f || v0.position.y < -1.f || v0.position.y > 1.f)
-				{
-					continue;
-				}
-
-				if (v1.position.x < -1.f || v1.position.x > 1.f || v1.position.y < -1.f || v1.position.y > 1.f)
-				{
-					continue;
-				}
-
-				if (v2.position.x < -1.f || v2.position.x > 1.f || v2.position.y < -1.f || v2.position.y > 1.f)
-				{
-					continue;
-				}
-
-				v0.position.x = (v0.position.x + 1) / 2.f * static_cast<float>(m_Width);
-				v0.position.y = (1 - v0.position.y) / 2.f * static_cast<float>(m_Height);
-
-				v1.position.x = (v1.position.x + 1) / 2.f * static_cast<float>(m_Width);
-				v1.position.y = (1 - v1.position.y) / 2.f * static_cast<float>(m_Height);
-
-				v2.position.x = (v2.position.x + 1) / 2.f * static_cast<float>(m_Width);
-				v2.position.y = (1 - v2.position.y) / 2.f * static_cast<float>(m_Height);
-
-				const int minX{ dae::Clamp(int(std::min(v0.position.x, std::min(v1.position.x, v2.position.x))),0,m_Width)};
-				const int maxX{ dae::Clamp(int(std::max(v0.position.x, std::max(v1.position.x, v2.position.x))),0,m_Width)};
-				const int minY{ dae::Clamp(int(std::min(v0.position.y, std::min(v1.position.y, v2.position.y))),0,m_Height) };
-				const int maxY{ dae::Clamp(int(std::max(v0.position.y, std::max(v1.position.y, v2.position.y))),0,m_Height) };
-				RenderTriangle(v0, v1, v2, succes, { minX,minY,maxX - minX,maxY - minY });
+				worldViewProjection[row][column] = _mm_set1_ps(worldViewProjectionMatrix[row][column]);
+			}
+			for (int column{}; column < 3; ++column)
+			{
+				world[row][column] = _mm_set1_ps(worldMatrix[row][column]);
 			}
 		}
+		const __m128 cameraPosition[3]{ _mm_set1_ps(cameraOrigin.x), _mm_set1_ps(cameraOrigin.y), _mm_set1_ps(cameraOrigin.z) };
 
-		if (mesh->primitiveTopology == PrimitiveTopology::TriangleStrip)
+		//Every vertex only writes its own slot, so the chunks can run on any thread in any order
+		const int nrVertices{ static_cast<int>(streams.clipX.size()) };
+		const auto transformChunk = [&](int chunkIndex)
 		{
-			for (size_t i{}; i < mesh->indices.size() - 2; ++i)
+			const int firstVertex{ chunkIndex * m_TransformChunkSize };
+			const int lastVertex{ std::min(firstVertex + m_TransformChunkSize, nrVertices) };
+			for (int i{ firstVertex }; i < lastVertex; i += 4)
 			{
-				Vertex_Out_Rasterizer v0{ vertices_ndc[mesh->indices[i]] };
-				Vertex_Out_Rasterizer v1{ vertices_ndc[mesh->indices[i + 1]] };
-				Vertex_Out_Rasterizer v2{ vertices_ndc[mesh->indices[i + 2]] };
-
-				if (i % 2 == 0)
+				const __m128 position[3]{ _mm_loadu_ps(&streams.position.x[i]), _mm_loadu_ps(&streams.position.y[i]), _mm_loadu_ps(&streams.position.z[i]) };
+				const __m128 normal[3]{ _mm_loadu_ps(&streams.normal.x[i]), _mm_loadu_ps(&streams.normal.y[i]), _mm_loadu_ps(&streams.normal.z[i]) };
+				const __m128 tangent[3]{ _mm_loadu_ps(&streams.tangent.x[i]), _mm_loadu_ps(&streams.tangent.y[i]), _mm_loadu_ps(&streams.tangent.z[i]) };
+
+				//Stays in clip space, the perspective divide happens after clipping
+				__m128 clip[4]{};
+				__m128 worldPosition[3]{};
+				__m128 worldNormal[3]{};
+				__m128 worldTangent[3]{};
+				for (int column{}; column < 4; ++column)
 				{
-					v1 = vertices_ndc[mesh->indices[i + 2]];
-					v2 = vertices_ndc[mesh->indices[i + 1]];
+					clip[column] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(position[0], worldViewProjection[0][column]),
+						_mm_mul_ps(position[1], worldViewProjection[1][column])),
+						_mm_mul_ps(position[2], worldViewProjection[2][column])),
+						worldViewProjection[3][column]);
 				}
-
-				if (v0.position.x < -1.f || v0.position.x > 1.f || v0.position.y < -1.f || v0.position.y > 1.f)
-				{
-					continue;
-				}
-
-				if (v1.position.x < -1.f || v1.position.x > 1.f || v1.position.y < -1.f || v1.position.y > 1.f)
-				{
-					continue;
-				}
-
-				if (v2.position.x < -1.f || v2.position.x > 1.f || v2.position.y < -1.f || v2.position.y > 1.f)
+				for (int column{}; column < 3; ++column)
 				{
-					continue;
+					worldNormal[column] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(normal[0], world[0][column]), _mm_mul_ps(normal[1], world[1][column])), _mm_mul_ps(normal[2], world[2][column]));
+					worldTangent[column] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tangent[0], world[0][column]), _mm_mul_ps(tangent[1], world[1][column])), _mm_mul_ps(tangent[2], world[2][column]));
+					worldPosition[column] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(position[0], world[0][column]), _mm_mul_ps(position[1], world[1][column])), _mm_mul_ps(position[2], world[2][column])), world[3][column]);
 				}
 
-				v0.position.x = (v0.position.x + 1) / 2.f * static_cast<float>(m_Width);
-				v0.position.y = (1 - v0.position.y) / 2.f * static_cast<float>(m_Height);
-
-				v1.position.x = (v1.position.x + 1) / 2.f * static_cast<float>(m_Width);
-				v1.position.y = (1 - v1.position.y) / 2.f * static_cast<float>(m_Height);
-
-				v2.position.x = (v2.position.x + 1) / 2.f * static_cast<float>(m_Width);
-				v2.position.y = (1 - v2.position.y) / 2.f * static_cast<float>(m_Height);
-
-				const int minX{ static_cast<int>(std::max(0.f,std::min(v0.position.x - 1, std::min(v1.position.x - 1, v2.position.x - 1)))) };
-				const int width{ static_cast<int>(std::min(static_cast<float>(m_Width),std::max(v0.position.x + 1, std::max(v1.position.x + 1, v2.position.x + 1)))) - minX };
-				const int minY{ static_cast<int>(std::max(0.f,std::min(v0.position.y - 1, std::min(v1.position.y - 1, v2.position.y - 1)))) };
-				const int height{ static_cast<int>(std::min(static_cast<float>(m_Height),std::max(v0.position.y + 1, std::max(v1.position.y + 1, v2.position.y + 1)))) - minY };
-				RenderTriangle(v0, v1, v2, succes, { minX,minY,width,height });
-				if (succes)
-				{
-					break;
-				}
+				const __m128 normalLength{ _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(worldNormal[0], worldNormal[0]), _mm_mul_ps(worldNormal[1], worldNormal[1])), _mm_mul_ps(worldNormal[2], worldNormal[2]))) };
+
+				_mm_storeu_ps(&streams.clipX[i], clip[0]);
+				_mm_storeu_ps(&streams.clipY[i], clip[1]);
+				_mm_storeu_ps(&streams.clipZ[i], clip[2]);
+				_mm_storeu_ps(&streams.clipW[i], clip[3]);
+				_mm_storeu_ps(&streams.worldNormal.x[i], _mm_div_ps(worldNormal[0], normalLength));
+				_mm_storeu_ps(&streams.worldNormal.y[i], _mm_div_ps(worldNormal[1], normalLength));
+				_mm_storeu_ps(&streams.worldNormal.z[i], _mm_div_ps(worldNormal[2], normalLength));
+				_mm_storeu_ps(&streams.worldTangent.x[i], worldTangent[0]);
+				_mm_storeu_ps(&streams.worldTangent.y[i], worldTangent[1]);
+				_mm_storeu_ps(&streams.worldTangent.z[i], worldTangent[2]);
+				_mm_storeu_ps(&streams.viewDirection.x[i], _mm_sub_ps(worldPosition[0], cameraPosition[0]));
+				_mm_storeu_ps(&streams.viewDirection.y[i], _mm_sub_ps(worldPosition[1], cameraPosition[1]));
+				_mm_storeu_ps(&streams.viewDirection.z[i], _mm_sub_ps(worldPosition[2], cameraPosition[2]));
 			}
+		};
+
+		//Not parallel when this already runs as a job of the thread pool
+		const int nrChunks{ (nrVertices + m_TransformChunkSize - 1) / m_TransformChunkSize };
+#if defined(ASYNC)
+		if (isParallel)
+		{
+			m_pThreadPool->ParallelFor(nrChunks, transformChunk);
+			continue;
+		}
+#endif
+		for (int chunkIndex{}; chunkIndex < nrChunks; ++chunkIndex)
+		{
+			transformChunk(chunkIndex);
 		}
 	}
-
-	//@END
-//Update SDL Surface
-	SDL_UnlockSurface(m_pBackBuffer);
-	SDL_BlitSurface(m_pBackBuffer, 0, m_pFrontBuffer, 0);
-	SDL_UpdateWindowSurface(m_pWindow);
 }
 
-static ColorRGB Lambert(float kd, const ColorRGB& cd)
+void dae::RasterizerRenderer::CreateVertexStreams(const Mesh* mesh, MeshVertexStreams& streams) const
 {
+	//The padding vertices sit at the origin with a unit normal, the transform runs over them but nothing indexes them
+	const size_t nrVertices{ (mesh->vertices.size() + 3) / 4 * 4 };
+	std::vector<float>* allStreams[]{
+		&streams.position.x, &streams.position.y, &streams.position.z,
+		&streams.normal.x, &streams.normal.y, &streams.normal.z,
+		&streams.tangent.x, &streams.tangent.y, &streams.tangent.z,
+		&streams.u, &streams.v,
+		&streams.clipX, &streams.clipY, &streams.clipZ, &streams.clipW,
+		&streams.worldNormal.x, &streams.worldNormal.y, &streams.worldNormal.z,
+		&streams.worldTangent.x, &streams.worldTangent.y, &streams.worldTangent.z,
+		&streams.viewDirection.x, &streams.viewDirection.y, &streams.viewDirection.z };
+	for (std::vector<float>* stream : allStreams)
+	{
+		stream->assign(nrVertices, 0.f);
+	}
+	std::fill(streams.normal.z.begin(), streams.normal.z.end(), 1.f);
 
-	return cd * kd / PI;
+	for (size_t i{}; i < mesh->vertices.size(); ++i)
+	{
+		const Vertex_In& vert{ mesh->vertices[i] };
+		streams.position.x[i] = vert.position.x;
+		streams.position.y[i] = vert.position.y;
+		streams.position.z[i] = vert.position.z;
+		streams.normal.x[i] = vert.normal.x;
+		streams.normal.y[i] = vert.normal.y;
+		streams.normal.z[i] = vert.normal.z;
+		streams.tangent.x[i] = vert.tangent.x;
+		streams.tangent.y[i] = vert.tangent.y;
+		streams.tangent.z[i] = vert.tangent.z;
+		streams.u[i] = vert.uv.x;
+		streams.v[i] = vert.uv.y;
+	}
 }
 
-static ColorRGB Lambert(const ColorRGB& kd, const ColorRGB& cd)
+void dae::RasterizerRenderer::CreateTriangleClusters(const Mesh* mesh, const MeshVertexStreams& streams, std::vector<TriangleCluster>& clusters) const
 {
+	const uint32_t nrIndices{ static_cast<uint32_t>(mesh->indices.size()) };
+	const uint32_t nrTriangles{ mesh->primitiveTopology == PrimitiveTopology::TriangeList ? nrIndices / 3 : (nrIndices >= 3 ? nrIndices - 2 : 0) };
+	const uint32_t indicesPerTriangle{ mesh->primitiveTopology == PrimitiveTopology::TriangeList ? 3u : 1u };
 
-	return cd * kd / PI;
+	clusters.clear();
+	for (uint32_t firstTriangle{}; firstTriangle < nrTriangles; firstTriangle += m_TrianglesPerCluster)
+	{
+		TriangleCluster cluster{};
+		cluster.firstTriangle = firstTriangle;
+		cluster.nrTriangles = std::min(m_TrianglesPerCluster, nrTriangles - firstTriangle);
+
+		//A strip's triangle i uses indices i to i + 2, a list's uses 3i to 3i + 2
+		const uint32_t firstIndex{ firstTriangle * indicesPerTriangle };
+		const uint32_t lastIndex{ (firstTriangle + cluster.nrTriangles - 1) * indicesPerTriangle + 2 };
+		Vector3 minPosition{ FLT_MAX, FLT_MAX, FLT_MAX };
+		Vector3 maxPosition{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (uint32_t i{ firstIndex }; i <= lastIndex; ++i)
+		{
+			const uint32_t vertexIndex{ mesh->indices[i] };
+			const Vector3 position{ streams.position.x[vertexIndex], streams.position.y[vertexIndex], streams.position.z[vertexIndex] };
+			minPosition = { std::min(minPosition.x, position.x), std::min(minPosition.y, position.y), std::min(minPosition.z, position.z) };
+			maxPosition = { std::max(maxPosition.x, position.x), std::max(maxPosition.y, position.y), std::max(maxPosition.z, position.z) };
+		}
+		cluster.center = (minPosition + maxPosition) / 2.f;
+		clusters.push_back(cluster);
+	}
 }
 
-static ColorRGB Phong(float ks, float exp, const Vector3& l, const Vector3& v, const Vector3& n)
+void dae::RasterizerRenderer::SortDrawOrder()
 {
-	const Vector3 reflect{ Vector3::Reflect(l,n) };
+	m_DrawOrder.clear();
+	const Matrix cameraWorldView{ m_pCamera->GetWorldViewProjectionMatrix() };
+	for (uint32_t meshIndex{}; meshIndex < m_MeshesWorld.size(); ++meshIndex)
+	{
+		const Matrix worldViewProjectionMatrix{ m_MeshesWorld[meshIndex]->worldMatrix * cameraWorldView };
+		const std::vector<TriangleCluster>& clusters{ m_MeshClusters[meshIndex] };
+		const size_t firstDraw{ m_DrawOrder.size() };
+		float meshDepth{ FLT_MAX };
+		for (uint32_t clusterIndex{}; clusterIndex < clusters.size(); ++clusterIndex)
+		{
+			//Clip space w is the distance along the view direction
+			const float depth{ m_UseFrontToBackOrder ? worldViewProjectionMatrix.TransformPoint(Vector4{ clusters[clusterIndex].center, 1.f }).w : 0.f };
+			meshDepth = std::min(meshDepth, depth);
+			m_DrawOrder.push_back({ 0.f, depth, meshIndex, clusterIndex });
+		}
 
-	const float cosReflect{ ks * powf(std::max(0.0f,Vector3::Dot(reflect, v)), exp) };
-	return { cosReflect, cosReflect, cosReflect };
+		//A mesh is as near as its nearest cluster
+		for (size_t i{ firstDraw }; i < m_DrawOrder.size(); ++i)
+		{
+			m_DrawOrder[i].meshDepth = m_UseFrontToBackOrder ? meshDepth : 0.f;
+		}
+	}
+
+	//Stable, so with the ordering off (every depth 0) the clusters stay in index order
+	std::stable_sort(m_DrawOrder.begin(), m_DrawOrder.end(), [](const ClusterToDraw& a, const ClusterToDraw& b)
+		{
+			if (a.meshDepth != b.meshDepth)
+			{
+				return a.meshDepth < b.meshDepth;
+			}
+			if (a.meshIndex != b.meshIndex)
+			{
+				return a.meshIndex < b.meshIndex;
+			}
+			return a.depth < b.depth;
+		});
 }
 
-ColorRGB RasterizerRenderer::Diffuse(const Vector2& uv, const float observedArea)
+dae::Vertex_Out_Rasterizer dae::RasterizerRenderer::MeshVertexStreams::GetVertex(uint32_t index) const
 {
-	const ColorRGB lightColor{ m_pTexture->Sample(uv) };
-	const float lightIntensity{ 7.f };
-	const ColorRGB radiance{ lightColor * lightIntensity };
-
-	const auto lambert{ Lambert(observedArea,radiance) };
-	return lambert;
+	Vertex_Out_Rasterizer vertex{};
+	vertex.position = { clipX[index], clipY[index], clipZ[index], clipW[index] };
+	vertex.uv = { u[index], v[index] };
+	vertex.normal = { worldNormal.x[index], worldNormal.y[index], worldNormal.z[index] };
+	vertex.tangent = { worldTangent.x[index], worldTangent.y[index], worldTangent.z[index] };
+	vertex.viewDirection = { viewDirection.x[index], viewDirection.y[index], viewDirection.z[index] };
+	return vertex;
 }
 
-ColorRGB RasterizerRenderer::Specular(const Vertex_Out_Rasterizer& v, const Vector3& vectorNormal, const Vector3& lightDirection)
+void dae::RasterizerRenderer::SetRenderResolution(int width, int height)
 {
-	ColorRGB sampledSpecularColor{ m_pSpecularTexture->Sample(v.uv) };
-	ColorRGB phongExponent{ m_pGlossTexture->Sample(v.uv) };
-	const float shininess{ 25.f };
-
-	const auto phong{ Phong(1.f ,phongExponent.r * shininess  ,lightDirection,-v.viewDirection,vectorNormal) };
-	return  phong * sampledSpecularColor;
+	//Only called between frames, the tile and block data is rebuilt every frame anyway
+	m_RenderWidth = width;
+	m_RenderHeight = height;
+	m_NrTilesX = (m_RenderWidth + m_TileSize - 1) / m_TileSize;
+	m_NrTilesY = (m_RenderHeight + m_TileSize - 1) / m_TileSize;
+	m_TileMaxDepth.resize(m_NrTilesX * m_NrTilesY);
+	m_NrBlocksX = (m_RenderWidth + m_BlockSize - 1) / m_BlockSize;
+	m_NrBlocksY = (m_RenderHeight + m_BlockSize - 1) / m_BlockSize;
+	m_BlockMaxDepth.resize(m_NrBlocksX * m_NrBlocksY);
+	m_BlockNeedsClear.resize(m_NrBlocksX * m_NrBlocksY);
 }
 
-ColorRGB RasterizerRenderer::PixelShading(const Vertex_Out_Rasterizer& v)
+void dae::RasterizerRenderer::UpdateResolutionScale(float frameTime)
 {
-	Vector3 lightDirection{ .577f,-.577f,.577f };
-	Vector3 vectorNormal{ v.normal };
-
-	if (v.uv.x < 0 || v.uv.x > 1
-		|| v.uv.y < 0 || v.uv.y > 1) {
-		return{};
-	}
+	//Smoothed over roughly the last 10 frames, so a single slow frame doesn't change the resolution
+	const float smoothing{ 0.1f };
+	m_AverageFrameTime = m_AverageFrameTime > 0.f ? m_AverageFrameTime + (frameTime - m_AverageFrameTime) * smoothing : frameTime;
 
-	if (m_ShowNormalMap)
-	{
-		Vector3 binormal{ Vector3::Cross(v.normal,v.tangent) };
-		Matrix tangentSpaceAxis{ v.tangent,binormal,v.normal,Vector3::Zero };
-		ColorRGB sampledNormalColor{ m_pNormalTexture->Sample(v.uv) };
-		sampledNormalColor = 2.f * sampledNormalColor - 1.f;
-		Vector3 sampledNormal{ Vector3(sampledNormalColor.r, sampledNormalColor.g, sampledNormalColor.b) };
-		vectorNormal = tangentSpaceAxis.TransformVector(sampledNormal).Normalized();
-	}
-	float observedArea{ Vector3::Dot(-lightDirection, vectorNormal) };
-	if (observedArea < 0.f)
+	//Leave some room on both sides of the target, otherwise the scale never settles
+	const float budgetRatio{ m_TargetFrameTime / m_AverageFrameTime };
+	if (budgetRatio > 0.9f && budgetRatio < 1.1f)
 	{
-		observedArea = 0;
+		return;
 	}
 
+	//Most of the cost is per pixel, which goes with the square of the scale. At most 5% per frame, so the
+	//average has time to catch up with the new resolution
+	const float scaleChange{ dae::Clamp(std::sqrt(budgetRatio), 0.95f, 1.05f) };
+	const float newScale{ dae::Clamp(m_ResolutionScale * scaleChange, m_MinResolutionScale, 1.f) };
 
-	switch (m_LightningMode)
+	//Only rebuild when the scale actually changes the size
+	const int width{ std::max(1, static_cast<int>(static_cast<float>(m_Width) * newScale)) };
+	const int height{ std::max(1, static_cast<int>(static_cast<float>(m_Height) * newScale)) };
+	m_ResolutionScale = newScale;
+	if (width != m_RenderWidth || height != m_RenderHeight)
 	{
-	case LightningMode::ObservedArea:
+		SetRenderResolution(width, height);
+	}
+}
+
+void dae::RasterizerRenderer::OptimiseWithTriangleStrip(std::vector<Uint32>& indices)
+{
+
+	for (int i{ 1 }; i < indices.size() - 2; i += 2)
 	{
+		const Uint32 indice2{ indices[i + 1] }, indice3{ indices[i + 2] };
+		indices[i + 1] = indice3;
+		indices[i + 2] = indice2;
+	}
+}
 
-		return { observedArea,observedArea,observedArea };
+bool dae::RasterizerRenderer::SetupTriangle(const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2, TriangleToRaster& triangle, TriangleAttributes& attributes) const
+{
+	const Vertex_Out_Rasterizer* vertices[3]{ &v0, &v1, &v2 };
+
+	int64_t fixedX[3]{};
+	int64_t fixedY[3]{};
+	for (int i{}; i < 3; ++i)
+	{
+		fixedX[i] = std::llround(vertices[i]->position.x * static_cast<float>(m_SubPixelPrecision));
+		fixedY[i] = std::llround(vertices[i]->position.y * static_cast<float>(m_SubPixelPrecision));
 	}
-	case LightningMode::Diffuse:
-		return Diffuse(v.uv, observedArea);
-	case LightningMode::Specular:
-		return Specular(v, vectorNormal, lightDirection);
-	case LightningMode::Combined:
+
+	//The three weights always add up to the same (doubled, signed) area, no need to sum them per pixel.
+	//Its sign is the winding on screen, which is all the cull mode needs, and at zero nothing gets covered
+	const int64_t signedArea{ (fixedX[2] - fixedX[1]) * (fixedY[0] - fixedY[1]) - (fixedY[2] - fixedY[1]) * (fixedX[0] - fixedX[1]) };
+	const bool isCulled{ signedArea > 0 ? m_CullState == CullState::back : m_CullState == CullState::front };
+	if (signedArea == 0 || isCulled)
 	{
-		constexpr ColorRGB ambient{ 0.025f,0.025f,0.025f };
-		return Diffuse(v.uv, observedArea) + Specular(v, vectorNormal, -lightDirection) + ambient;
+		return false;
 	}
+	const int64_t winding{ signedArea < 0 ? -1 : 1 };
+	const int64_t totalArea{ signedArea * winding };
+
+	for (int i{}; i < 3; ++i)
+	{
+		const int start{ (i + 1) % 3 };
+		const int end{ (i + 2) % 3 };
+		const int64_t directionX{ (fixedX[end] - fixedX[start]) * winding };
+		const int64_t directionY{ (fixedY[end] - fixedY[start]) * winding };
+
+		//Cross(direction, pixel - start) with the pixel in fixed point as well
+		triangle.edgeStepX[i] = static_cast<int32_t>(-directionY * m_SubPixelPrecision);
+		triangle.edgeStepY[i] = static_cast<int32_t>(directionX * m_SubPixelPrecision);
+		triangle.edgeConstant[i] = directionY * fixedX[start] - directionX * fixedY[start];
+
+		//Top-left fill rule: a pixel exactly on an edge belongs to the triangle only when that edge is a top edge
+		//(horizontal with the inside below it) or a left edge, so two triangles sharing an edge never both cover it
+		const bool isTopLeft{ directionY < 0 || (directionY == 0 && directionX > 0) };
+		if (!isTopLeft)
+		{
+			triangle.edgeConstant[i] -= 1;
+		}
+	}
+
+	//Every plane starts at the snapped first vertex, where the weights are exactly (1, 0, 0). The gradient of
+	//sum(value * weight) is sum(value * edgeStep) / area, the edge steps and the area are both in 1/256ths
+	triangle.originX = static_cast<float>(fixedX[0]) / static_cast<float>(m_SubPixelPrecision);
+	triangle.originY = static_cast<float>(fixedY[0]) / static_cast<float>(m_SubPixelPrecision);
+	const double invTotalArea{ 1.0 / static_cast<double>(totalArea) };
+	const auto makePlane = [&triangle, invTotalArea](float value0, float value1, float value2) -> AttributePlane
+	{
+		const double values[3]{ value0, value1, value2 };
+		double stepX{};
+		double stepY{};
+		for (int i{}; i < 3; ++i)
+		{
+			stepX += values[i] * triangle.edgeStepX[i];
+			stepY += values[i] * triangle.edgeStepY[i];
+		}
+		return { value0, static_cast<float>(stepX * invTotalArea), static_cast<float>(stepY * invTotalArea) };
+	};
+
+	//Depth is interpolated affinely: z/w is linear in screen space, and it stays finite for vertices the near plane
+	//clip put at z = 0, where 1/z would not be
+	const AttributePlane depth{ makePlane(v0.position.z, v1.position.z, v2.position.z) };
+	triangle.z = depth.value;
+	triangle.zStepX = depth.stepX;
+	triangle.zStepY = depth.stepY;
+
+	//Dividing by w once per vertex here is what makes the per pixel interpolation perspective correct
+	const float invW[3]{ 1.f / v0.position.w, 1.f / v1.position.w, 1.f / v2.position.w };
+	attributes.invW = makePlane(invW[0], invW[1], invW[2]);
+	for (int i{}; i < 2; ++i)
+	{
+		attributes.uv[i] = makePlane(v0.uv[i] * invW[0], v1.uv[i] * invW[1], v2.uv[i] * invW[2]);
+	}
+	for (int i{}; i < 3; ++i)
+	{
+		attributes.normal[i] = makePlane(v0.normal[i] * invW[0], v1.normal[i] * invW[1], v2.normal[i] * invW[2]);
+		attributes.tangent[i] = makePlane(v0.tangent[i] * invW[0], v1.tangent[i] * invW[1], v2.tangent[i] * invW[2]);
+		attributes.viewDirection[i] = makePlane(v0.viewDirection[i] * invW[0], v1.viewDirection[i] * invW[1], v2.viewDirection[i] * invW[2]);
+	}
+
+	//Inside the triangle the interpolated depth is a weighted mean of the vertex depths, so it never drops below
+	//the smallest one. The slack covers the rounding of that interpolation
+	const float minZ{ std::min(v0.position.z, std::min(v1.position.z, v2.position.z)) };
+	triangle.nearestZ = minZ - std::abs(minZ) * 4.f * FLT_EPSILON;
+	return true;
+}
+
+//Depth test and masked write of one packet per depth format. Only the first nrLanes pixels are read or written,
+//the stencil bits of Unorm24Stencil8 are left as they are
+static __m128 TestAndWriteFloat32(float* pDepth, int nrLanes, __m128 lerpZ, __m128 mask)
+{
+	alignas(16) float currentDepth[4]{ FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX };
+	if (nrLanes == 4)
+	{
+		_mm_store_ps(currentDepth, _mm_loadu_ps(pDepth));
+	}
+	else
+	{
+		std::copy_n(pDepth, nrLanes, currentDepth);
+	}
+
+	const __m128 current{ _mm_load_ps(currentDepth) };
+	mask = _mm_and_ps(mask, _mm_cmple_ps(lerpZ, current));
+	const __m128 newDepth{ _mm_or_ps(_mm_and_ps(mask, lerpZ), _mm_andnot_ps(mask, current)) };
+	if (nrLanes == 4)
+	{
+		_mm_storeu_ps(pDepth, newDepth);
+	}
+	else
+	{
+		_mm_store_ps(currentDepth, newDepth);
+		std::copy_n(currentDepth, nrLanes, pDepth);
+	}
+	return mask;
+}
+
+static __m128 TestAndWriteUnorm24Stencil8(uint32_t* pDepth, int nrLanes, __m128 lerpZ, __m128 mask)
+{
+	alignas(16) uint32_t currentValues[4]{ 0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF };
+	std::copy_n(pDepth, nrLanes, currentValues);
+
+	//24 bit values are positive as int32, so the signed compare works
+	const __m128i depthMask{ _mm_set1_epi32(0x00FFFFFF) };
+	const __m128i current{ _mm_load_si128(reinterpret_cast<const __m128i*>(currentValues)) };
+	const __m128i newDepth{ _mm_cvtps_epi32(_mm_mul_ps(lerpZ, _mm_set1_ps(static_cast<float>(0x00FFFFFF)))) };
+	const __m128i passes{ _mm_andnot_si128(_mm_cmpgt_epi32(newDepth, _mm_and_si128(current, depthMask)), _mm_set1_epi32(-1)) };
+	mask = _mm_and_ps(mask, _mm_castsi128_ps(passes));
+
+	const __m128i writeMask{ _mm_castps_si128(mask) };
+	const __m128i newValues{ _mm_or_si128(newDepth, _mm_andnot_si128(depthMask, current)) };
+	_mm_store_si128(reinterpret_cast<__m128i*>(currentValues), _mm_or_si128(_mm_and_si128(writeMask, newValues), _mm_andnot_si128(writeMask, current)));
+	std::copy_n(currentValues, nrLanes, pDepth);
+	return mask;
+}
+
+static __m128 TestAndWriteUnorm16(uint16_t* pDepth, int nrLanes, __m128 lerpZ, __m128 mask)
+{
+	alignas(16) uint16_t currentValues[8]{ 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
+	std::copy_n(pDepth, nrLanes, currentValues);
+
+	const __m128i current{ _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(currentValues)), _mm_setzero_si128()) };
+	const __m128i newDepth{ _mm_cvtps_epi32(_mm_mul_ps(lerpZ, _mm_set1_ps(static_cast<float>(0xFFFF)))) };
+	const __m128i passes{ _mm_andnot_si128(_mm_cmpgt_epi32(newDepth, current), _mm_set1_epi32(-1)) };
+	mask = _mm_and_ps(mask, _mm_castsi128_ps(passes));
+
+	//Back to 16 bits: shift into signed range so the saturating pack keeps every value, then shift back
+	const __m128i writeMask{ _mm_castps_si128(mask) };
+	const __m128i newValues{ _mm_or_si128(_mm_and_si128(writeMask, newDepth), _mm_andnot_si128(writeMask, current)) };
+	const __m128i bias{ _mm_set1_epi32(0x8000) };
+	const __m128i packed{ _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(newValues, bias), _mm_setzero_si128()), _mm_set1_epi16(static_cast<short>(0x8000))) };
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(currentValues), packed);
+	std::copy_n(currentValues, nrLanes, pDepth);
+	return mask;
+}
+
+__m128 dae::RasterizerRenderer::TestAndWriteDepth(int pixelIndex, int nrLanes, __m128 lerpZ, __m128 mask)
+{
+	switch (m_DepthFormat)
+	{
+	case DepthFormat::Unorm24Stencil8:
+		return TestAndWriteUnorm24Stencil8(reinterpret_cast<uint32_t*>(m_pDepthBuffer) + pixelIndex, nrLanes, lerpZ, mask);
+	case DepthFormat::Unorm16:
+		return TestAndWriteUnorm16(reinterpret_cast<uint16_t*>(m_pDepthBuffer) + pixelIndex, nrLanes, lerpZ, mask);
 	default:
+		return TestAndWriteFloat32(reinterpret_cast<float*>(m_pDepthBuffer) + pixelIndex, nrLanes, lerpZ, mask);
+	}
+}
+
+void dae::RasterizerRenderer::RenderTriangle(const TriangleToRaster& triangle, const TriangleAttributes& attributes, uint32_t triangleIndex, const SDL_Rect& boundaries, RasterStatistics& statistics)
+{
+	const int maxX{ boundaries.x + boundaries.w };
+	const int maxY{ boundaries.y + boundaries.h };
+
+	if (m_BoundingBoxToggled)
+	{
+		const uint32_t white{ MapRGB(255, 255, 255) };
+		for (int blockY{ boundaries.y - boundaries.y % m_BlockSize }; blockY <= maxY; blockY += m_BlockSize)
+		{
+			for (int blockX{ boundaries.x - boundaries.x % m_BlockSize }; blockX <= maxX; blockX += m_BlockSize)
+			{
+				ClearBlockIfNeeded(blockX, blockY);
+			}
+		}
+		const int nrSamples{ m_UseMsaa ? m_MaxNrSamples : 1 };
+		for (int py{ boundaries.y }; py <= maxY; ++py)
+		{
+			for (int px{ boundaries.x }; px <= maxX; ++px)
+			{
+				for (int sample{}; sample < nrSamples; ++sample)
+				{
+					m_ColorBuffer[PixelIndex(px, py) + sample * m_NrBufferPixels] = white;
+				}
+			}
+		}
+		return;
+	}
+
+	//Packets of 4 horizontally adjacent pixels: coverage, depth and the depth test run in SSE,
+	//only the pixels left in the final mask drop down to scalar code for shading
+	const __m128 laneOffsets{ _mm_setr_ps(0.f, 1.f, 2.f, 3.f) };
+	const __m128 zero{ _mm_setzero_ps() };
+	const __m128 one{ _mm_set1_ps(1.f) };
+	const __m128i minusOne{ _mm_set1_epi32(-1) };
+
+	//Coverage steps the exact integer edge values, depth steps the 1/z plane
+	__m128i edgeLaneSteps[3]{};
+	__m128i edgePacketSteps[3]{};
+	for (int i{}; i < 3; ++i)
+	{
+		const int32_t edgeStep{ triangle.edgeStepX[i] };
+		edgeLaneSteps[i] = _mm_setr_epi32(0, edgeStep, 2 * edgeStep, 3 * edgeStep);
+		edgePacketSteps[i] = _mm_set1_epi32(4 * edgeStep);
+	}
+	const __m128 zLaneSteps{ _mm_mul_ps(laneOffsets, _mm_set1_ps(triangle.zStepX)) };
+	const __m128 zPacketStep{ _mm_set1_ps(4.f * triangle.zStepX) };
+
+	//Without MSAA the only sample is the pixel itself. The offsets are in 1/16ths of a pixel like the snapped
+	//vertices, and the edge steps are per whole pixel, so the edge values at a sample stay exact
+	const int nrSamples{ m_UseMsaa ? m_MaxNrSamples : 1 };
+	int64_t sampleEdgeOffsets[4][3]{};
+	__m128 sampleZOffsets[4]{};
+	int64_t minSampleEdgeOffsets[3]{};
+	int64_t maxSampleEdgeOffsets[3]{};
+	for (int sample{}; sample < nrSamples; ++sample)
+	{
+		const int offsetX{ m_UseMsaa ? m_MsaaSampleOffsets[sample][0] : 0 };
+		const int offsetY{ m_UseMsaa ? m_MsaaSampleOffsets[sample][1] : 0 };
+		for (int i{}; i < 3; ++i)
+		{
+			sampleEdgeOffsets[sample][i] = (static_cast<int64_t>(triangle.edgeStepX[i]) * offsetX + static_cast<int64_t>(triangle.edgeStepY[i]) * offsetY) / m_SubPixelPrecision;
+			minSampleEdgeOffsets[i] = std::min(minSampleEdgeOffsets[i], sampleEdgeOffsets[sample][i]);
+			maxSampleEdgeOffsets[i] = std::max(maxSampleEdgeOffsets[i], sampleEdgeOffsets[sample][i]);
+		}
+		sampleZOffsets[sample] = _mm_set1_ps((triangle.zStepX * static_cast<float>(offsetX) + triangle.zStepY * static_cast<float>(offsetY)) / static_cast<float>(m_SubPixelPrecision));
+	}
+
+	//Walk the screen aligned 8x8 blocks the boundaries overlap. The edges are linear, so their values at the
+	//block corners tell whether a block is completely outside (skipped) or completely inside (no coverage test)
+	const int firstBlockX{ boundaries.x - boundaries.x % m_BlockSize };
+	const int firstBlockY{ boundaries.y - boundaries.y % m_BlockSize };
+	for (int blockY{ firstBlockY }; blockY <= maxY; blockY += m_BlockSize)
+	{
+		for (int blockX{ firstBlockX }; blockX <= maxX; blockX += m_BlockSize)
+		{
+			//Hierarchical Z: everything in the block is already nearer than this triangle can get
+			if (triangle.nearestZ > m_BlockMaxDepth[blockX / m_BlockSize + (blockY / m_BlockSize) * m_NrBlocksX])
+			{
+				++statistics.nrBlocksRejected;
+				continue;
+			}
+
+			const int blockMinX{ std::max(blockX, boundaries.x) };
+			const int blockMinY{ std::max(blockY, boundaries.y) };
+			const int blockMaxX{ std::min(blockX + m_BlockSize - 1, maxX) };
+			const int blockMaxY{ std::min(blockY + m_BlockSize - 1, maxY) };
+
+			//The samples sit around the pixel corners, so the corner values are widened by how far they reach
+			bool isOutside{ false };
+			bool isFullyCovered{ true };
+			for (int i{}; i < 3; ++i)
+			{
+				const int64_t corners[4]{
+					triangle.EdgeValue(i, blockMinX, blockMinY),
+					triangle.EdgeValue(i, blockMaxX, blockMinY),
+					triangle.EdgeValue(i, blockMinX, blockMaxY),
+					triangle.EdgeValue(i, blockMaxX, blockMaxY) };
+				isOutside |= *std::max_element(corners, corners + 4) + maxSampleEdgeOffsets[i] < 0;
+				isFullyCovered &= *std::min_element(corners, corners + 4) + minSampleEdgeOffsets[i] >= 0;
+			}
+
+			if (isOutside)
+			{
+				continue;
+			}
+			ClearBlockIfNeeded(blockX, blockY);
+			const __m128 lastX{ _mm_set1_ps(static_cast<float>(blockMaxX)) };
+			bool hasWrittenDepth{ false };
+
+			for (int py{ blockMinY }; py <= blockMaxY; ++py)
+			{
+				//Evaluate the edges once at the start of the row, then step them to the right. A block is at most
+				//8 pixels wide, so a value clamped to 2^30 can't change sign or overflow while stepping through it
+				__m128i edgeValues[4][3]{};
+				for (int sample{}; sample < nrSamples; ++sample)
+				{
+					for (int i{}; i < 3; ++i)
+					{
+						const int64_t rowValue{ triangle.EdgeValue(i, blockMinX, py) + sampleEdgeOffsets[sample][i] };
+						const int64_t clampedRowValue{ std::max<int64_t>(-(int64_t{ 1 } << 30), std::min<int64_t>(rowValue, int64_t{ 1 } << 30)) };
+						edgeValues[sample][i] = _mm_add_epi32(_mm_set1_epi32(static_cast<int32_t>(clampedRowValue)), edgeLaneSteps[i]);
+					}
+				}
+				const float rowZ{ triangle.z + triangle.zStepX * (static_cast<float>(blockMinX) - triangle.originX) + triangle.zStepY * (static_cast<float>(py) - triangle.originY) };
+				__m128 z{ _mm_add_ps(_mm_set1_ps(rowZ), zLaneSteps) };
+
+				for (int px{ blockMinX }; px <= blockMaxX; px += 4)
+				{
+					const int pixelIndex{ PixelIndex(px, py) };
+					const int nrLanes{ std::min(4, blockMaxX - px + 1) };
+					const __m128 packetZ{ z };
+					z = _mm_add_ps(z, zPacketStep);
+					const __m128 inBoundaries{ _mm_cmple_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(px)), laneOffsets), lastX) };
+
+					//Per sample a mask of the lanes that won it, a lane gets shaded when it won any of its samples
+					int sampleLanes[4]{};
+					int coveredLanes{};
+					int laneMask{};
+					for (int sample{}; sample < nrSamples; ++sample)
+					{
+						const __m128i value0{ edgeValues[sample][0] };
+						const __m128i value1{ edgeValues[sample][1] };
+						const __m128i value2{ edgeValues[sample][2] };
+						for (int i{}; i < 3; ++i)
+						{
+							edgeValues[sample][i] = _mm_add_epi32(edgeValues[sample][i], edgePacketSteps[i]);
+						}
+
+						__m128 mask{ inBoundaries };
+						if (!isFullyCovered)
+						{
+							const __m128i isInside{ _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(value0, minusOne), _mm_cmpgt_epi32(value1, minusOne)), _mm_cmpgt_epi32(value2, minusOne)) };
+							mask = _mm_and_ps(mask, _mm_castsi128_ps(isInside));
+							if (_mm_movemask_ps(mask) == 0)
+							{
+								continue;
+							}
+						}
+						const __m128 lerpZ{ _mm_add_ps(packetZ, sampleZOffsets[sample]) };
+						mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(lerpZ, zero), _mm_cmple_ps(lerpZ, one)));
+
+						//Never touch pixels past the boundaries, they can belong to a tile on another thread
+						coveredLanes |= _mm_movemask_ps(mask);
+						mask = TestAndWriteDepth(pixelIndex + sample * m_NrBufferPixels, nrLanes, lerpZ, mask);
+						sampleLanes[sample] = _mm_movemask_ps(mask);
+						laneMask |= sampleLanes[sample];
+					}
+
+					statistics.nrFragmentsRejected += static_cast<int>(std::bitset<4>(coveredLanes & ~laneMask).count());
+					if (laneMask == 0)
+					{
+						continue;
+					}
+					hasWrittenDepth = true;
+
+					//The visibility buffer only remembers who won the pixel, shading waits until every triangle is in
+					if (m_UseVisibilityBuffer)
+					{
+						for (int sample{}; sample < nrSamples; ++sample)
+						{
+							uint32_t* pTriangleIndices{ m_VisibilityBuffer.data() + pixelIndex + sample * m_NrBufferPixels };
+							for (int lane{}; lane < 4; ++lane)
+							{
+								if (sampleLanes[sample] & (1 << lane))
+								{
+									pTriangleIndices[lane] = triangleIndex;
+								}
+							}
+						}
+						statistics.nrFragmentsPassed += static_cast<int>(std::bitset<4>(laneMask).count());
+						continue;
+					}
+
+					//Shaded at the pixel itself, whichever of its samples were covered
+					alignas(16) float depths[4]{};
+					_mm_store_ps(depths, packetZ);
+					for (int lane{}; lane < 4; ++lane)
+					{
+						if (laneMask & (1 << lane))
+						{
+							const uint32_t color{ ShadePixel(triangle, attributes, px + lane, py, depths[lane]) };
+							for (int sample{}; sample < nrSamples; ++sample)
+							{
+								if (sampleLanes[sample] & (1 << lane))
+								{
+									m_ColorBuffer[pixelIndex + lane + sample * m_NrBufferPixels] = color;
+								}
+							}
+							++statistics.nrFragmentsPassed;
+						}
+					}
+				}
+			}
+
+			if (hasWrittenDepth)
+			{
+				UpdateBlockMaxDepth(blockX, blockY);
+			}
+		}
+	}
+}
+
+int dae::RasterizerRenderer::ShadeVisibilityBuffer(const FrameSetup& frame, int tileIndex)
+{
+	const int tileMinX{ (tileIndex % m_NrTilesX) * m_TileSize };
+	const int tileMinY{ (tileIndex / m_NrTilesX) * m_TileSize };
+	const int tileMaxX{ std::min(tileMinX + m_TileSize, m_RenderWidth) - 1 };
+	const int tileMaxY{ std::min(tileMinY + m_TileSize, m_RenderHeight) - 1 };
+
+	const int nrSamples{ m_UseMsaa ? m_MaxNrSamples : 1 };
+	int nrFragmentsShaded{};
+	for (int blockY{ tileMinY }; blockY <= tileMaxY; blockY += m_BlockSize)
+	{
+		for (int blockX{ tileMinX }; blockX <= tileMaxX; blockX += m_BlockSize)
+		{
+			//No triangle reached the block, its depth and triangle indices are left over from another frame
+			if (m_BlockNeedsClear[blockX / m_BlockSize + (blockY / m_BlockSize) * m_NrBlocksX])
+			{
+				continue;
+			}
+
+			const int blockMaxX{ std::min(blockX + m_BlockSize - 1, tileMaxX) };
+			const int blockMaxY{ std::min(blockY + m_BlockSize - 1, tileMaxY) };
+			for (int py{ blockY }; py <= blockMaxY; ++py)
+			{
+				for (int px{ blockX }; px <= blockMaxX; ++px)
+				{
+					//With MSAA the samples of a pixel can belong to different triangles, each of them is shaded once
+					const int pixelIndex{ PixelIndex(px, py) };
+					for (int sample{}; sample < nrSamples; ++sample)
+					{
+						//Cleared along with the block, so an index that is still invalid means nothing covered the sample
+						const uint32_t triangleIndex{ m_VisibilityBuffer[pixelIndex + sample * m_NrBufferPixels] };
+						bool isShaded{ triangleIndex == UINT32_MAX };
+						for (int previousSample{}; previousSample < sample && !isShaded; ++previousSample)
+						{
+							isShaded = m_VisibilityBuffer[pixelIndex + previousSample * m_NrBufferPixels] == triangleIndex;
+						}
+						if (isShaded)
+						{
+							continue;
+						}
+
+						//The depth buffer may hold a quantized depth, the triangle's own plane gives the exact one back
+						const TriangleToRaster& triangle{ frame.triangles[triangleIndex] };
+						const float z{ triangle.z + triangle.zStepX * (static_cast<float>(px) - triangle.originX) + triangle.zStepY * (static_cast<float>(py) - triangle.originY) };
+						const uint32_t color{ ShadePixel(triangle, frame.triangleAttributes[triangleIndex], px, py, z) };
+						for (int laterSample{ sample }; laterSample < nrSamples; ++laterSample)
+						{
+							if (m_VisibilityBuffer[pixelIndex + laterSample * m_NrBufferPixels] == triangleIndex)
+							{
+								m_ColorBuffer[pixelIndex + laterSample * m_NrBufferPixels] = color;
+							}
+						}
+						++nrFragmentsShaded;
+					}
+				}
+			}
+		}
+	}
+	return nrFragmentsShaded;
+}
+
+void dae::RasterizerRenderer::ClearBlockIfNeeded(int blockX, int blockY)
+{
+	uint8_t& needsClear{ m_BlockNeedsClear[blockX / m_BlockSize + (blockY / m_BlockSize) * m_NrBlocksX] };
+	if (!needsClear)
+	{
+		return;
+	}
+	needsClear = 0;
+
+	//The buffers are rounded up to whole blocks, so all 8 rows exist even at the bottom and right edges
+	const int nrSamples{ m_UseMsaa ? m_MaxNrSamples : 1 };
+	for (int row{}; row < m_BlockSize * nrSamples; ++row)
+	{
+		const int firstPixel{ PixelIndex(blockX, blockY + row % m_BlockSize) + row / m_BlockSize * m_NrBufferPixels };
+		switch (m_DepthFormat)
+		{
+		case DepthFormat::Float32:
+			std::fill_n(reinterpret_cast<float*>(m_pDepthBuffer) + firstPixel, m_BlockSize, FLT_MAX);
+			break;
+		case DepthFormat::Unorm24Stencil8:
+			std::fill_n(reinterpret_cast<uint32_t*>(m_pDepthBuffer) + firstPixel, m_BlockSize, 0x00FFFFFFu);
+			break;
+		case DepthFormat::Unorm16:
+			std::fill_n(reinterpret_cast<uint16_t*>(m_pDepthBuffer) + firstPixel, m_BlockSize, uint16_t{ 0xFFFF });
+			break;
+		}
+		std::fill_n(m_ColorBuffer.data() + firstPixel, m_BlockSize, m_ClearColor);
+		if (m_UseVisibilityBuffer)
+		{
+			std::fill_n(m_VisibilityBuffer.data() + firstPixel, m_BlockSize, UINT32_MAX);
+		}
+	}
+}
+
+void dae::RasterizerRenderer::UpdateBlockMaxDepth(int blockX, int blockY)
+{
+	const int maxX{ std::min(blockX + m_BlockSize, m_RenderWidth) };
+	const int maxY{ std::min(blockY + m_BlockSize, m_RenderHeight) };
+	const int width{ maxX - blockX };
+	const int nrSamples{ m_UseMsaa ? m_MaxNrSamples : 1 };
+
+	//Every sample plane of the block counts
+	float maxDepth{ 0.f };
+	if (m_DepthFormat == DepthFormat::Float32)
+	{
+		__m128 maxDepths{ _mm_setzero_ps() };
+		for (int row{}; row < (maxY - blockY) * nrSamples; ++row)
+		{
+			const float* pDepth{ reinterpret_cast<const float*>(m_pDepthBuffer) + PixelIndex(blockX, blockY + row % (maxY - blockY)) + row / (maxY - blockY) * m_NrBufferPixels };
+			int x{};
+			for (; x + 4 <= width; x += 4)
+			{
+				maxDepths = _mm_max_ps(maxDepths, _mm_loadu_ps(pDepth + x));
+			}
+			for (; x < width; ++x)
+			{
+				maxDepth = std::max(maxDepth, pDepth[x]);
+			}
+		}
+
+		alignas(16) float lanes[4]{};
+		_mm_store_ps(lanes, maxDepths);
+		maxDepth = std::max(std::max(maxDepth, lanes[0]), std::max(lanes[1], std::max(lanes[2], lanes[3])));
+	}
+	else
+	{
+		const bool isUnorm16{ m_DepthFormat == DepthFormat::Unorm16 };
+		uint32_t maxValue{};
+		for (int row{}; row < (maxY - blockY) * nrSamples; ++row)
+		{
+			const int firstPixel{ PixelIndex(blockX, blockY + row % (maxY - blockY)) + row / (maxY - blockY) * m_NrBufferPixels };
+			for (int x{}; x < width; ++x)
+			{
+				const uint32_t value{ isUnorm16 ? reinterpret_cast<const uint16_t*>(m_pDepthBuffer)[firstPixel + x] : reinterpret_cast<const uint32_t*>(m_pDepthBuffer)[firstPixel + x] & 0x00FFFFFF };
+				maxValue = std::max(maxValue, value);
+			}
+		}
+
+		//A depth passes when it rounds to at most maxValue, so anything up to half a step above it still can
+		const float range{ isUnorm16 ? static_cast<float>(0xFFFF) : static_cast<float>(0x00FFFFFF) };
+		maxDepth = (static_cast<float>(maxValue) + 0.5f) / range;
+	}
+	m_BlockMaxDepth[blockX / m_BlockSize + (blockY / m_BlockSize) * m_NrBlocksX] = maxDepth;
+}
+
+void dae::RasterizerRenderer::UpdateTileMaxDepth(int tileIndex)
+{
+	const int blocksPerTile{ m_TileSize / m_BlockSize };
+	const int firstBlockX{ (tileIndex % m_NrTilesX) * blocksPerTile };
+	const int firstBlockY{ (tileIndex / m_NrTilesX) * blocksPerTile };
+	const int lastBlockX{ std::min(firstBlockX + blocksPerTile, m_NrBlocksX) };
+	const int lastBlockY{ std::min(firstBlockY + blocksPerTile, m_NrBlocksY) };
+
+	float maxDepth{ 0.f };
+	for (int blockY{ firstBlockY }; blockY < lastBlockY; ++blockY)
+	{
+		for (int blockX{ firstBlockX }; blockX < lastBlockX; ++blockX)
+		{
+			maxDepth = std::max(maxDepth, m_BlockMaxDepth[blockX + blockY * m_NrBlocksX]);
+		}
+	}
+	m_TileMaxDepth[tileIndex] = maxDepth;
+}
+
+uint32_t dae::RasterizerRenderer::ShadePixel(const TriangleToRaster& triangle, const TriangleAttributes& attributes, int px, int py, float lerpZ)
+{
+	const Vector2 screenSpacePos{ static_cast<float>(px),static_cast<float>(py) };
+	ColorRGB finalColor{ 1.f,1.f,1.f };
+
+	switch (m_State)
+	{
+	case RenderState::Texture:
+	{
+		const float dx{ screenSpacePos.x - triangle.originX };
+		const float dy{ screenSpacePos.y - triangle.originY };
+		const float lerpW{ 1.f / attributes.invW.At(dx, dy) };
+		const Vector2 uv{ Vector2{ attributes.uv[0].At(dx, dy), attributes.uv[1].At(dx, dy) } * lerpW };
+		//Screen space uv derivatives for picking a mip level, straight from the planes: d(U/W) = (dU - u * dW) / W
+		Vector2 uvDx{};
+		Vector2 uvDy{};
+		if (m_TextureFilter != Texture::FilterMode::Point)
+		{
+			uvDx = Vector2{ attributes.uv[0].stepX - uv.x * attributes.invW.stepX, attributes.uv[1].stepX - uv.y * attributes.invW.stepX } * lerpW;
+			uvDy = Vector2{ attributes.uv[0].stepY - uv.x * attributes.invW.stepY, attributes.uv[1].stepY - uv.y * attributes.invW.stepY } * lerpW;
+		}
+		const Vector3 normal{ Vector3{ attributes.normal[0].At(dx, dy), attributes.normal[1].At(dx, dy), attributes.normal[2].At(dx, dy) }.Normalized() };
+		const Vector3 tangent{ Vector3{ attributes.tangent[0].At(dx, dy), attributes.tangent[1].At(dx, dy), attributes.tangent[2].At(dx, dy) }.Normalized() };
+		const Vector3 viewDir{ Vector3{ attributes.viewDirection[0].At(dx, dy), attributes.viewDirection[1].At(dx, dy), attributes.viewDirection[2].At(dx, dy) }.Normalized() };
+		const Vector4 pos{ screenSpacePos.x,screenSpacePos.y, lerpZ, lerpW };
+		Vertex_Out_Rasterizer pixelVertex{ pos, finalColor, uv, normal, tangent, viewDir };
+		finalColor = PixelShading(pixelVertex, uvDx, uvDy);
 		break;
 	}
-	return {  };
+	case RenderState::DepthBuffer:
+	{
+		Remap(lerpZ, .995f, 1.f);
+		finalColor = { lerpZ, lerpZ, lerpZ };
+		break;
+	}
+	}
+
+	return PackColor(finalColor);
 }
 
-void dae::RasterizerRenderer::Remap(float& depth, const float min, const float max)
+uint32_t dae::RasterizerRenderer::MapRGB(uint8_t r, uint8_t g, uint8_t b) const
 {
-	if (depth > max || depth < min)
+	//Same as SDL_MapRGB for a format without a palette
+	return (static_cast<uint32_t>(r >> m_PixelPacking.redLoss) << m_PixelPacking.redShift)
+		| (static_cast<uint32_t>(g >> m_PixelPacking.greenLoss) << m_PixelPacking.greenShift)
+		| (static_cast<uint32_t>(b >> m_PixelPacking.blueLoss) << m_PixelPacking.blueShift)
+		| m_PixelPacking.alphaMask;
+}
+
+uint32_t dae::RasterizerRenderer::PackColor(const ColorRGB& color) const
+{
+	//MaxToOne, scale to 255 and truncate, all three channels at once. The clamp only matters for
+	//negative channels, where the old uint8_t cast wasn't defined anyway
+	const __m128 channels{ _mm_setr_ps(color.r, color.g, color.b, 0.f) };
+	const float maxValue{ std::max(color.r, std::max(color.g, color.b)) };
+	const __m128 normalized{ maxValue > 1.f ? _mm_div_ps(channels, _mm_set1_ps(maxValue)) : channels };
+	const __m128 scaled{ _mm_min_ps(_mm_max_ps(_mm_mul_ps(normalized, _mm_set1_ps(255.f)), _mm_setzero_ps()), _mm_set1_ps(255.f)) };
+
+	alignas(16) int32_t bytes[4]{};
+	_mm_store_si128(reinterpret_cast<__m128i*>(bytes), _mm_cvttps_epi32(scaled));
+	return MapRGB(static_cast<uint8_t>(bytes[0]), static_cast<uint8_t>(bytes[1]), static_cast<uint8_t>(bytes[2]));
+}
+
+static Vertex_Out_Rasterizer LerpVertex(const Vertex_Out_Rasterizer& from, const Vertex_Out_Rasterizer& to, float factor)
+{
+	Vertex_Out_Rasterizer vertex{};
+	vertex.position = from.position + (to.position - from.position) * factor;
+	vertex.color = ColorRGB::Lerp(from.color, to.color, factor);
+	vertex.uv = from.uv + (to.uv - from.uv) * factor;
+	vertex.normal = from.normal + (to.normal - from.normal) * factor;
+	vertex.tangent = from.tangent + (to.tangent - from.tangent) * factor;
+	vertex.viewDirection = from.viewDirection + (to.viewDirection - from.viewDirection) * factor;
+	return vertex;
+}
+
+void dae::RasterizerRenderer::AddMeshTriangle(FrameSetup& frame, const Mesh* mesh, const MeshVertexStreams& streams, uint32_t triangleNumber) const
+{
+	if (mesh->primitiveTopology == PrimitiveTopology::TriangeList)
 	{
+		const uint32_t i{ triangleNumber * 3 };
+		AddTriangle(frame, streams.GetVertex(mesh->indices[i]), streams.GetVertex(mesh->indices[i + 1]), streams.GetVertex(mesh->indices[i + 2]));
 		return;
 	}
 
-	const float maxMinusMin{ max - min };
-	const float depthMinusMin{ depth - min };
-	depth = depthMinusMin / maxMinusMin;
+	//Every other triangle of a strip is wound the other way around
+	const uint32_t i{ triangleNumber };
+	if (i % 2 == 0)
+	{
+		AddTriangle(frame, streams.GetVertex(mesh->indices[i]), streams.GetVertex(mesh->indices[i + 2]), streams.GetVertex(mesh->indices[i + 1]));
+	}
+	else
+	{
+		AddTriangle(frame, streams.GetVertex(mesh->indices[i]), streams.GetVertex(mesh->indices[i + 1]), streams.GetVertex(mesh->indices[i + 2]));
+	}
+}
+
+void dae::RasterizerRenderer::AddTriangle(FrameSetup& frame, const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2) const
+{
+	//Clip space planes as signed distances, a vertex is on the inside when the distance is >= 0.
+	//The first 6 are the view frustum, the last 5 are the ones we actually clip against: the near plane
+	//and the guard band, which is wide enough that crossing it almost never happens
+	const auto planeDistance = [this](const Vector4& position, int plane) -> float
+	{
+		switch (plane)
+		{
+		case 0: return position.w + position.x;
+		case 1: return position.w - position.x;
+		case 2: return position.w + position.y;
+		case 3: return position.w - position.y;
+		case 4: return position.w - position.z;
+		case 5: return position.z;
+		case 6: return m_GuardBand * position.w + position.x;
+		case 7: return m_GuardBand * position.w - position.x;
+		case 8: return m_GuardBand * position.w + position.y;
+		case 9: return m_GuardBand * position.w - position.y;
+		default: return 0.f;
+		}
+	};
+
+	//Entirely outside one of the frustum planes, nothing of it can reach the screen
+	for (int plane{}; plane < 6; ++plane)
+	{
+		if (planeDistance(v0.position, plane) < 0.f && planeDistance(v1.position, plane) < 0.f && planeDistance(v2.position, plane) < 0.f)
+		{
+			return;
+		}
+	}
+
+	//Sutherland-Hodgman, each plane can add at most one vertex to the polygon
+	const int maxPolygonSize{ 8 };
+	Vertex_Out_Rasterizer polygon[maxPolygonSize]{ v0, v1, v2 };
+	int polygonSize{ 3 };
+	const int clipPlanes[]{ 5, 6, 7, 8, 9 };
+	for (const int plane : clipPlanes)
+	{
+		float distances[maxPolygonSize]{};
+		bool isClipped{ false };
+		for (int i{}; i < polygonSize; ++i)
+		{
+			distances[i] = planeDistance(polygon[i].position, plane);
+			isClipped |= distances[i] < 0.f;
+		}
+		if (!isClipped)
+		{
+			continue;
+		}
+
+		Vertex_Out_Rasterizer clipped[maxPolygonSize]{};
+		int clippedSize{};
+		for (int i{}; i < polygonSize; ++i)
+		{
+			const int next{ (i + 1) % polygonSize };
+			if (distances[i] >= 0.f)
+			{
+				clipped[clippedSize++] = polygon[i];
+			}
+			if ((distances[i] >= 0.f) != (distances[next] >= 0.f))
+			{
+				clipped[clippedSize++] = LerpVertex(polygon[i], polygon[next], distances[i] / (distances[i] - distances[next]));
+			}
+		}
+
+		if (clippedSize < 3)
+		{
+			return;
+		}
+		std::copy(clipped, clipped + clippedSize, polygon);
+		polygonSize = clippedSize;
+	}
+
+	for (int i{}; i < polygonSize; ++i)
+	{
+		Vector4& position{ polygon[i].position };
+		position.x /= position.w;
+		position.y /= position.w;
+		position.z /= position.w;
+		position.x = (position.x + 1) / 2.f * static_cast<float>(m_RenderWidth);
+		position.y = (1 - position.y) / 2.f * static_cast<float>(m_RenderHeight);
+	}
+
+	for (int i{ 1 }; i < polygonSize - 1; ++i)
+	{
+		AddScreenTriangle(frame, polygon[0], polygon[i], polygon[i + 1]);
+	}
 }
 
-bool dae::RasterizerRenderer::CanRenderTriangle(const Vector3& v1, const Vector3& v2, const Vector3& viewDir)
+void dae::RasterizerRenderer::AddScreenTriangle(FrameSetup& frame, const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2) const
 {
+	//Guard band: whatever sticks out of the screen is dealt with by clamping the bounding box instead of clipping.
+	//MSAA samples are off the pixel center, so a pixel just outside the triangle can still have one inside
+	const float sampleReach{ m_UseMsaa ? m_MsaaSampleReach : 0.f };
+	const float minX{ std::min(v0.position.x, std::min(v1.position.x, v2.position.x)) - sampleReach };
+	const float maxX{ std::max(v0.position.x, std::max(v1.position.x, v2.position.x)) + sampleReach };
+	const float minY{ std::min(v0.position.y, std::min(v1.position.y, v2.position.y)) - sampleReach };
+	const float maxY{ std::max(v0.position.y, std::max(v1.position.y, v2.position.y)) + sampleReach };
+	if (maxX < 0.f || maxY < 0.f || minX >= static_cast<float>(m_RenderWidth) || minY >= static_cast<float>(m_RenderHeight))
+	{
+		return;
+	}
 
-	Vector3 normal{ Vector3::Cross(v1,v2).Normalized() };
+	const int boundaryMinX{ dae::Clamp(static_cast<int>(minX), 0, m_RenderWidth - 1) };
+	const int boundaryMaxX{ dae::Clamp(static_cast<int>(maxX), 0, m_RenderWidth - 1) };
+	const int boundaryMinY{ dae::Clamp(static_cast<int>(minY), 0, m_RenderHeight - 1) };
+	const int boundaryMaxY{ dae::Clamp(static_cast<int>(maxY), 0, m_RenderHeight - 1) };
 
-	if (m_CullState == CullState::front)
+	TriangleToRaster triangle{};
+	triangle.boundaries = { boundaryMinX, boundaryMinY, boundaryMaxX - boundaryMinX, boundaryMaxY - boundaryMinY };
+	TriangleAttributes attributes{};
+	if (!SetupTriangle(v0, v1, v2, triangle, attributes))
 	{
-		if (Vector3::Dot(viewDir, normal) > 0.f)
+		++frame.nrTrianglesCulled;
+		return;
+	}
+	frame.triangles.push_back(triangle);
+	frame.triangleAttributes.push_back(attributes);
+}
+
+void dae::RasterizerRenderer::BinTriangles(FrameSetup& frame) const
+{
+	frame.tileBins.resize(m_NrTilesX * m_NrTilesY);
+	for (std::vector<uint32_t>& bin : frame.tileBins)
+	{
+		bin.clear();
+	}
+
+	for (uint32_t triangleIndex{}; triangleIndex < frame.triangles.size(); ++triangleIndex)
+	{
+		const SDL_Rect& boundaries{ frame.triangles[triangleIndex].boundaries };
+		//The boundaries are inclusive on both ends
+		const int minTileX{ dae::Clamp(boundaries.x / m_TileSize, 0, m_NrTilesX - 1) };
+		const int maxTileX{ dae::Clamp((boundaries.x + boundaries.w) / m_TileSize, 0, m_NrTilesX - 1) };
+		const int minTileY{ dae::Clamp(boundaries.y / m_TileSize, 0, m_NrTilesY - 1) };
+		const int maxTileY{ dae::Clamp((boundaries.y + boundaries.h) / m_TileSize, 0, m_NrTilesY - 1) };
+
+		for (int tileY{ minTileY }; tileY <= maxTileY; ++tileY)
 		{
-			return false;
+			for (int tileX{ minTileX }; tileX <= maxTileX; ++tileX)
+			{
+				frame.tileBins[tileX + tileY * m_NrTilesX].push_back(triangleIndex);
+			}
 		}
 	}
-	else if (m_CullState == CullState::back)
+}
+
+void dae::RasterizerRenderer::RenderTile(const FrameSetup& frame, int tileIndex)
+{
+	const int tileMinX{ (tileIndex % m_NrTilesX) * m_TileSize };
+	const int tileMinY{ (tileIndex / m_NrTilesX) * m_TileSize };
+	const int tileMaxX{ std::min(tileMinX + m_TileSize, m_RenderWidth) - 1 };
+	const int tileMaxY{ std::min(tileMinY + m_TileSize, m_RenderHeight) - 1 };
+
+	RasterStatistics statistics{};
+	for (const uint32_t triangleIndex : frame.tileBins[tileIndex])
 	{
-		if (Vector3::Dot(viewDir, normal) > 0.f)
+		const TriangleToRaster& triangle{ frame.triangles[triangleIndex] };
+		const SDL_Rect& boundaries{ triangle.boundaries };
+
+		const int minX{ std::max(boundaries.x, tileMinX) };
+		const int minY{ std::max(boundaries.y, tileMinY) };
+		const int maxX{ std::min(boundaries.x + boundaries.w, tileMaxX) };
+		const int maxY{ std::min(boundaries.y + boundaries.h, tileMaxY) };
+		if (minX > maxX || minY > maxY)
+		{
+			continue;
+		}
+
+		if (triangle.nearestZ > m_TileMaxDepth[tileIndex])
 		{
-			return false;
+			continue;
+		}
+
+		const int nrFragmentsPassed{ statistics.nrFragmentsPassed };
+		RenderTriangle(triangle, frame.triangleAttributes[triangleIndex], triangleIndex, { minX,minY,maxX - minX,maxY - minY }, statistics);
+		if (statistics.nrFragmentsPassed > nrFragmentsPassed)
+		{
+			UpdateTileMaxDepth(tileIndex);
 		}
 	}
-	else if (m_CullState == CullState::none)
+
+	m_NrFragmentsPassed += statistics.nrFragmentsPassed;
+	m_NrFragmentsRejected += statistics.nrFragmentsRejected;
+	m_NrBlocksRejected += statistics.nrBlocksRejected;
+	m_NrFragmentsShaded += m_UseVisibilityBuffer ? ShadeVisibilityBuffer(frame, tileIndex) : statistics.nrFragmentsPassed;
+	ResolveTile(tileIndex);
+}
+
+//Per channel average of the 4 samples of a pixel, rounded to nearest. Every channel, alpha included, is widened
+//to 16 bits so the sums can't overflow
+static uint32_t AverageSamples(const uint32_t* pSample, int sampleStride)
+{
+	const __m128i samples{ _mm_setr_epi32(static_cast<int>(pSample[0]), static_cast<int>(pSample[sampleStride]), static_cast<int>(pSample[2 * sampleStride]), static_cast<int>(pSample[3 * sampleStride])) };
+	const __m128i zero{ _mm_setzero_si128() };
+	const __m128i pairSums{ _mm_add_epi16(_mm_unpacklo_epi8(samples, zero), _mm_unpackhi_epi8(samples, zero)) };
+	const __m128i sums{ _mm_add_epi16(pairSums, _mm_srli_si128(pairSums, 8)) };
+	const __m128i averages{ _mm_srli_epi16(_mm_add_epi16(sums, _mm_set1_epi16(2)), 2) };
+	return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(averages, zero)));
+}
+
+void dae::RasterizerRenderer::ResolveTile(int tileIndex)
+{
+	const int tileMinX{ (tileIndex % m_NrTilesX) * m_TileSize };
+	const int tileMinY{ (tileIndex / m_NrTilesX) * m_TileSize };
+	const int tileMaxX{ std::min(tileMinX + m_TileSize, m_RenderWidth) };
+	const int tileMaxY{ std::min(tileMinY + m_TileSize, m_RenderHeight) };
+	const int surfaceWidth{ m_pBackBuffer->pitch / static_cast<int>(sizeof(uint32_t)) };
+
+	//A block row is contiguous in both layouts, so the tile goes over one block row at a time. Blocks no triangle
+	//reached never had their color cleared, they are filled with the clear color without going through the cache
+	const __m128i clearColor{ _mm_set1_epi32(static_cast<int>(m_ClearColor)) };
+	bool hasStreamed{ false };
+	for (int py{ tileMinY }; py < tileMaxY; ++py)
 	{
-		return false;
+		uint32_t* pSurfaceRow{ m_pBackBufferPixels + py * surfaceWidth };
+		for (int px{ tileMinX }; px < tileMaxX; px += m_BlockSize)
+		{
+			const int width{ std::min(m_BlockSize, tileMaxX - px) };
+			uint32_t* pSurface{ pSurfaceRow + px };
+			if (!m_BlockNeedsClear[px / m_BlockSize + (py / m_BlockSize) * m_NrBlocksX])
+			{
+				const uint32_t* pColor{ m_ColorBuffer.data() + PixelIndex(px, py) };
+				if (!m_UseMsaa)
+				{
+					std::copy_n(pColor, width, pSurface);
+					continue;
+				}
+				for (int x{}; x < width; ++x)
+				{
+					pSurface[x] = AverageSamples(pColor + x, m_NrBufferPixels);
+				}
+			}
+			else if (width == m_BlockSize && reinterpret_cast<uintptr_t>(pSurface) % 16 == 0)
+			{
+				_mm_stream_si128(reinterpret_cast<__m128i*>(pSurface), clearColor);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(pSurface + 4), clearColor);
+				hasStreamed = true;
+			}
+			else
+			{
+				std::fill_n(pSurface, width, m_ClearColor);
+			}
+		}
+	}
+
+	//Streaming stores are weakly ordered, make them visible before the surface gets blitted
+	if (hasStreamed)
+	{
+		_mm_sfence();
 	}
-	return true;
+}
+
+void dae::RasterizerRenderer::SetupFrame(FrameSetup& frame, bool isParallel)
+{
+	VertexTransformationFunction(m_MeshesWorld, m_MeshVertexStreams, isParallel);
+
+	//Clip every triangle, project it to the screen and bin it into the tiles it touches. The bins keep
+	//this submission order, so it is also the order every pixel sees the triangles in
+	frame.triangles.clear();
+	frame.triangleAttributes.clear();
+	frame.nrTrianglesCulled = 0;
+	SortDrawOrder();
+	for (const ClusterToDraw& draw : m_DrawOrder)
+	{
+		const TriangleCluster& cluster{ m_MeshClusters[draw.meshIndex][draw.clusterIndex] };
+		const Mesh* mesh{ m_MeshesWorld[draw.meshIndex] };
+		const MeshVertexStreams& streams{ m_MeshVertexStreams[draw.meshIndex] };
+		for (uint32_t triangleNumber{ cluster.firstTriangle }; triangleNumber < cluster.firstTriangle + cluster.nrTriangles; ++triangleNumber)
+		{
+			AddMeshTriangle(frame, mesh, streams, triangleNumber);
+		}
+	}
+	BinTriangles(frame);
+
+	frame.renderWidth = m_RenderWidth;
+	frame.renderHeight = m_RenderHeight;
+	frame.useMsaa = m_UseMsaa;
+	frame.isReady = true;
+}
+
+void dae::RasterizerRenderer::RenderMeshes()
+{
+	//@START
+//Lock BackBuffer
+	SDL_LockSurface(m_pBackBuffer);
+	const auto startTime{ std::chrono::steady_clock::now() };
+	Uint8 colorToMap{ 100 };
+
+	if (m_UniformColorToggled)
+	{
+		colorToMap = m_UniformClearColorRGBvalue;
+	}
+
+	//Every tile resolves its whole area, so the back buffer itself never needs clearing, and the internal
+	//buffers are cleared block by block as triangles reach them
+	m_ClearColor = MapRGB(colorToMap, colorToMap, colorToMap);
+	std::fill(m_BlockNeedsClear.begin(), m_BlockNeedsClear.end(), uint8_t{ 1 });
+	std::fill(m_BlockMaxDepth.begin(), m_BlockMaxDepth.end(), FLT_MAX);
+	std::fill(m_TileMaxDepth.begin(), m_TileMaxDepth.end(), FLT_MAX);
+	m_NrFragmentsPassed = 0;
+	m_NrFragmentsShaded = 0;
+	m_NrFragmentsRejected = 0;
+	m_NrBlocksRejected = 0;
+
+	//Setup: without pipelining, or when the frame set up last time no longer fits the settings, it happens right here
+	FrameSetup& rasterFrame{ m_FrameSetups[m_RasterFrameIndex] };
+	const bool isSetupOutdated{ rasterFrame.renderWidth != m_RenderWidth || rasterFrame.renderHeight != m_RenderHeight || rasterFrame.useMsaa != m_UseMsaa };
+	if (!m_UsePipelining || !rasterFrame.isReady || isSetupOutdated)
+	{
+		SetupFrame(rasterFrame, true);
+	}
+	m_NrTrianglesRasterized = static_cast<int>(rasterFrame.triangles.size());
+	m_NrTrianglesCulled = rasterFrame.nrTrianglesCulled;
+
+	//Raster: tiles never share a pixel, so they can be shaded in any order on any thread. With pipelining the
+	//next frame's setup is one more job, the first one handed out so it starts while the tiles fill the other threads
+	const int nrTiles{ m_NrTilesX * m_NrTilesY };
+	FrameSetup& nextFrame{ m_FrameSetups[1 - m_RasterFrameIndex] };
+	const auto renderJob = [this, &rasterFrame, &nextFrame](int jobIndex)
+	{
+		if (!m_UsePipelining)
+		{
+			RenderTile(rasterFrame, jobIndex);
+		}
+		else if (jobIndex == 0)
+		{
+			SetupFrame(nextFrame, false);
+		}
+		else
+		{
+			RenderTile(rasterFrame, jobIndex - 1);
+		}
+	};
+	const int nrJobs{ m_UsePipelining ? nrTiles + 1 : nrTiles };
+#if defined(ASYNC)
+	m_pThreadPool->ParallelFor(nrJobs, renderJob);
+#else
+	for (int jobIndex{}; jobIndex < nrJobs; ++jobIndex)
+	{
+		renderJob(jobIndex);
+	}
+#endif
+
+	if (m_UsePipelining)
+	{
+		rasterFrame.isReady = false;
+		m_RasterFrameIndex = 1 - m_RasterFrameIndex;
+	}
+
+	m_TotalRenderTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	++m_NrRenderedFrames;
+
+	//@END
+//Update SDL Surface
+	SDL_UnlockSurface(m_pBackBuffer);
+	if (m_RenderWidth == m_Width && m_RenderHeight == m_Height)
+	{
+		SDL_BlitSurface(m_pBackBuffer, 0, m_pFrontBuffer, 0);
+	}
+	else
+	{
+		//Same pixel format on both sides, so this is SDL's nearest neighbour stretch
+		SDL_Rect renderedArea{ 0, 0, m_RenderWidth, m_RenderHeight };
+		SDL_BlitScaled(m_pBackBuffer, &renderedArea, m_pFrontBuffer, nullptr);
+	}
+	SDL_UpdateWindowSurface(m_pWindow);
+
+	//Only frames this renderer drew count, Update also runs while the DirectX renderer is the one on screen.
+	//The new size applies from the next frame, the blit above still needed the old one
+	if (m_UseDynamicResolution)
+	{
+		UpdateResolutionScale(std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count());
+	}
+}
+
+static ColorRGB Lambert(float kd, const ColorRGB& cd)
+{
+
+	return cd * kd / PI;
+}
+
+static ColorRGB Lambert(const ColorRGB& kd, const ColorRGB& cd)
+{
+
+	return cd * kd / PI;
+}
+
+static ColorRGB Phong(float ks, float exp, const Vector3& l, const Vector3& v, const Vector3& n)
+{
+	const Vector3 reflect{ Vector3::Reflect(l,n) };
+
+	const float cosReflect{ ks * powf(std::max(0.0f,Vector3::Dot(reflect, v)), exp) };
+	return { cosReflect, cosReflect, cosReflect };
+}
+
+ColorRGB RasterizerRenderer::Diffuse(const ColorRGB& lightColor, const float observedArea)
+{
+	const float lightIntensity{ 7.f };
+	const ColorRGB radiance{ lightColor * lightIntensity };
+
+	const auto lambert{ Lambert(observedArea,radiance) };
+	return lambert;
+}
+
+ColorRGB RasterizerRenderer::Specular(const Vertex_Out_Rasterizer& v, const ColorRGB& sampledSpecularColor, const ColorRGB& phongExponent, const Vector3& vectorNormal, const Vector3& lightDirection)
+{
+	const float shininess{ 25.f };
+
+	const auto phong{ Phong(1.f ,phongExponent.r * shininess  ,lightDirection,-v.viewDirection,vectorNormal) };
+	return  phong * sampledSpecularColor;
+}
+
+ColorRGB RasterizerRenderer::PixelShading(const Vertex_Out_Rasterizer& v, const Vector2& uvDx, const Vector2& uvDy)
+{
+	Vector3 lightDirection{ .577f,-.577f,.577f };
+	Vector3 vectorNormal{ v.normal };
+
+	if (v.uv.x < 0 || v.uv.x > 1
+		|| v.uv.y < 0 || v.uv.y > 1) {
+		return{};
+	}
+
+	//With the material texture one read fills all four maps, otherwise each map is read on its own once the lighting mode needs it.
+	//There is no material texture while the maps are block compressed
+	ColorRGB materialColors[4]{};
+	const bool useMaterialTexture{ m_UseMaterialTexture && m_pMaterialTexture != nullptr };
+	if (useMaterialTexture)
+	{
+		m_pMaterialTexture->SampleLayers(v.uv, uvDx, uvDy, m_TextureFilter, materialColors);
+	}
+	const auto sampleMap{ [&](MaterialLayer layer, const Texture* pTexture)
+	{
+		if (useMaterialTexture)
+		{
+			return materialColors[static_cast<int>(layer)];
+		}
+		return pTexture->Sample(v.uv, uvDx, uvDy, m_TextureFilter);
+	} };
+
+	if (m_ShowNormalMap)
+	{
+		Vector3 binormal{ Vector3::Cross(v.normal,v.tangent) };
+		Matrix tangentSpaceAxis{ v.tangent,binormal,v.normal,Vector3::Zero };
+		ColorRGB sampledNormalColor{ sampleMap(MaterialLayer::Normal, m_pNormalTexture) };
+		sampledNormalColor = 2.f * sampledNormalColor - 1.f;
+		Vector3 sampledNormal{ Vector3(sampledNormalColor.r, sampledNormalColor.g, sampledNormalColor.b) };
+		vectorNormal = tangentSpaceAxis.TransformVector(sampledNormal).Normalized();
+	}
+	float observedArea{ Vector3::Dot(-lightDirection, vectorNormal) };
+	if (observedArea < 0.f)
+	{
+		observedArea = 0;
+	}
+
+
+	switch (m_LightningMode)
+	{
+	case LightningMode::ObservedArea:
+	{
+
+		return { observedArea,observedArea,observedArea };
+	}
+	case LightningMode::Diffuse:
+		return Diffuse(sampleMap(MaterialLayer::Diffuse, m_pTexture), observedArea);
+	case LightningMode::Specular:
+		return Specular(v, sampleMap(MaterialLayer::Specular, m_pSpecularTexture), sampleMap(MaterialLayer::Gloss, m_pGlossTexture), vectorNormal, lightDirection);
+	case LightningMode::Combined:
+	{
+		constexpr ColorRGB ambient{ 0.025f,0.025f,0.025f };
+		return Diffuse(sampleMap(MaterialLayer::Diffuse, m_pTexture), observedArea)
+			+ Specular(v, sampleMap(MaterialLayer::Specular, m_pSpecularTexture), sampleMap(MaterialLayer::Gloss, m_pGlossTexture), vectorNormal, -lightDirection) + ambient;
+	}
+	default:
+		break;
+	}
+	return {  };
+}
+
+void dae::RasterizerRenderer::Remap(float& depth, const float min, const float max)
+{
+	if (depth > max || depth < min)
+	{
+		return;
+	}
+
+	const float maxMinusMin{ max - min };
+	const float depthMinusMin{ depth - min };
+	depth = depthMinusMin / maxMinusMin;
 }
 
 bool RasterizerRenderer::SaveBufferToImage() const
 {
+	//With a lower render resolution only the top left of the back buffer is this frame's
+	if (m_RenderWidth != m_Width || m_RenderHeight != m_Height)
+	{
+		return SDL_SaveBMP(m_pFrontBuffer, "Rasterizer_ColorBuffer.bmp");
+	}
 	return SDL_SaveBMP(m_pBackBuffer, "Rasterizer_ColorBuffer.bmp");
 }
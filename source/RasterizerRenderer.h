@@ -1,5 +1,7 @@
 #pragma once
 #include "Renderer.h"
+#include <atomic>
+#include <immintrin.h>
 
 struct SDL_Window;
 struct SDL_Surface;
@@ -7,6 +9,7 @@ class MeshRasterizer;
 class Camera;
 namespace dae
 {
+	class ThreadPool;
 	class RasterizerRenderer :
 		public Renderer
 	{
@@ -24,6 +27,19 @@ namespace dae
 		virtual void ChangeCullMode() override;
 		void ChangeState();
 		void ChangeLightning();
+		void ToggleVisibilityBuffer();
+		void ToggleTiledLayout();
+		void CycleDepthFormat();
+		void ToggleFrontToBackOrder();
+		void ToggleMsaa();
+		void ToggleDynamicResolution();
+		void TogglePipelining();
+		void CycleTextureFilter();
+		void ToggleTexelLayout();
+		void BenchmarkTextureSampling();
+		void ToggleMaterialTexture();
+		void ToggleBlockCompression();
+		void PrintStatistics();
 		void ToggleNormalMap(bool canTurnOn) { m_ShowNormalMap = canTurnOn; }
 
 		bool SaveBufferToImage() const;
@@ -49,30 +65,289 @@ namespace dae
 
 		bool m_BoundingBoxToggled{ false };
 
+		//Dynamic resolution: the rasterizer renders m_RenderWidth x m_RenderHeight pixels, at most the window size, into
+		//the top left of the back buffer, which gets stretched over the window when it is smaller. The scale follows
+		//the times RenderMeshes measures, so a frame stays within m_TargetFrameTime
+		bool m_UseDynamicResolution{ false };
+		int m_RenderWidth{};
+		int m_RenderHeight{};
+		float m_ResolutionScale{ 1.f };
+		float m_AverageFrameTime{};
+		const float m_TargetFrameTime{ 1.f / 30.f };
+		const float m_MinResolutionScale{ 0.5f };
+
 		SDL_Surface* m_pFrontBuffer{ nullptr };
 		SDL_Surface* m_pBackBuffer{ nullptr };
 		uint32_t* m_pBackBufferPixels{};
+		//Internal framebuffer, everything is rendered here and resolved into m_pBackBufferPixels per tile
+		std::vector<uint32_t> m_ColorBuffer{};
+		//Pixels in one sample plane of the depth, color and visibility buffers. With MSAA on, sample s of a pixel is
+		//at PixelIndex + s * m_NrBufferPixels, so every plane has the same layout as the single sample buffers
+		int m_NrBufferPixels{};
+		//The back buffer's format never changes, so what SDL_MapRGB looks up every call is read once
+		struct PixelPacking
+		{
+			uint8_t redShift{};
+			uint8_t greenShift{};
+			uint8_t blueShift{};
+			uint8_t redLoss{};
+			uint8_t greenLoss{};
+			uint8_t blueLoss{};
+			uint32_t alphaMask{};
+		};
+		PixelPacking m_PixelPacking{};
 		Texture* m_pTexture{ nullptr };
 		Texture* m_pNormalTexture{ nullptr };
 		Texture* m_pSpecularTexture{ nullptr };
 		Texture* m_pGlossTexture{ nullptr };
+		//The four maps above interleaved into one texture, so shading a pixel reads one texel instead of four.
+		//The layers are in MaterialLayer order, it stays nullptr if the maps can't be interleaved
+		enum class MaterialLayer
+		{
+			Diffuse,
+			Normal,
+			Specular,
+			Gloss
+		};
+		Texture* m_pMaterialTexture{ nullptr };
+		bool m_UseMaterialTexture{ true };
+		//Block compression replaces the software texels of the four maps: the normal map becomes BC5, the others BC1, and the
+		//material texture is dropped since it would hold the uncompressed texels again. Lossy, so it starts off
+		bool m_UseBlockCompression{ false };
+		void ApplyBlockCompression();
+		//Point reads the full resolution texture like before, bilinear and trilinear go through the mip chain
+		Texture::FilterMode m_TextureFilter{ Texture::FilterMode::Point };
+		const int m_TotalTextureFilters{ 3 };
+
+		//Storage for the depth buffer in whichever format is selected, sized for the largest one (4 bytes per pixel)
+		enum class DepthFormat
+		{
+			Float32,
+			Unorm24Stencil8,
+			Unorm16
+		};
+		const int m_TotalDepthFormats{ 3 };
+		DepthFormat m_DepthFormat{ DepthFormat::Float32 };
+		uint8_t* m_pDepthBuffer{ nullptr };
 
-		float* m_pDepthBufferPixels;
+		//4x MSAA: coverage and depth are tested at 4 positions per pixel, shading still runs once per pixel and the
+		//color goes to every sample it won. The samples are averaged when a tile is resolved
+		bool m_UseMsaa{ false };
+		const int m_MaxNrSamples{ 4 };
+		//Sample positions relative to the pixel in 1/16ths of a pixel (the rotated grid D3D uses), and how far out they reach
+		const int m_MsaaSampleOffsets[4][2]{ { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+		const float m_MsaaSampleReach{ 6.f / 16.f };
 		RenderState m_State{ RenderState::Texture };
 		std::vector<Mesh*> m_MeshesWorld{};
 
 		bool m_ShowNormalMap{ true };
 
-		//Function that transforms the vertices from the mesh from World space to Screen space
-		void VertexTransformationFunction(const std::vector<Mesh*>& mesh, std::vector<Vertex_Out_Rasterizer>& vertices_out) const; //W1 Version
+		//Deferred mode: rasterize triangle indices and depth first, then shade every visible pixel exactly once
+		bool m_UseVisibilityBuffer{ false };
+		std::vector<uint32_t> m_VisibilityBuffer{};
+		std::atomic<int> m_NrFragmentsPassed{};
+		std::atomic<int> m_NrFragmentsShaded{};
+		//Covered fragments the depth test threw out before they reached shading, and 8x8 blocks hierarchical Z skipped
+		std::atomic<int> m_NrFragmentsRejected{};
+		std::atomic<int> m_NrBlocksRejected{};
+		int m_NrTrianglesRasterized{};
+		int m_NrTrianglesCulled{};
+		//Time spent in RenderMeshes since the last PrintStatistics
+		double m_TotalRenderTime{};
+		int m_NrRenderedFrames{};
+
+		//Depth, color and visibility buffer either store the screen row by row, or as 8x8 blocks one after the
+		//other so a triangle touching a few rows stays within a few cache lines. Both keep 4 pixels of a block row
+		//next to each other, which is all the packets need
+		bool m_UseTiledLayout{ true };
+
+		//Screen space triangle waiting in the tile bins to be rasterized. Only what the coverage and depth loops
+		//need lives here, so one triangle is exactly two cache lines; the vertex attributes are in TriangleAttributes
+		struct alignas(64) TriangleToRaster
+		{
+			//Edge function per barycentric weight (edge v1v2 for v0, v2v0 for v1, v0v1 for v2) on the 28.4 fixed point
+			//positions, so the value at a pixel is exact and in 1/256ths of a pixel squared. The edges are flipped for
+			//triangles with a negative area and hold the fill rule bias, a pixel is covered when all three are >= 0.
+			//Triangles the cull mode rejects and degenerate ones never make it into a record
+			int64_t edgeConstant[3]{};
+			int32_t edgeStepX[3]{};
+			int32_t edgeStepY[3]{};
+			SDL_Rect boundaries{};
+			//NDC z (z/w) is linear in screen space: its value at (originX, originY) and the change per pixel
+			float originX{};
+			float originY{};
+			float z{};
+			float zStepX{};
+			float zStepY{};
+			//No pixel of the triangle can end up nearer than this
+			float nearestZ{};
+
+			int64_t EdgeValue(int edge, int px, int py) const
+			{
+				return edgeConstant[edge] + static_cast<int64_t>(edgeStepX[edge]) * px + static_cast<int64_t>(edgeStepY[edge]) * py;
+			}
+		};
+
+		//Attribute / w (and 1/w itself) as a plane over the screen, relative to the origin of its TriangleToRaster
+		struct AttributePlane
+		{
+			float value{};
+			float stepX{};
+			float stepY{};
+
+			float At(float dx, float dy) const { return value + stepX * dx + stepY * dy; }
+		};
+
+		//Only read when a pixel gets shaded, same index as the triangle in FrameSetup::triangles
+		struct TriangleAttributes
+		{
+			AttributePlane invW{};
+			AttributePlane uv[2]{};
+			AttributePlane normal[3]{};
+			AttributePlane tangent[3]{};
+			AttributePlane viewDirection[3]{};
+		};
+
+		const int m_TileSize{ 64 };
+		const int m_BlockSize{ 8 };
+		//Vertices are snapped to 1/16th of a pixel before rasterizing
+		const int m_SubPixelPrecision{ 16 };
+		int m_NrTilesX{};
+		int m_NrTilesY{};
+		int m_NrBlocksX{};
+		int m_NrBlocksY{};
+		//Coarse levels on top of m_pDepthBuffer: the farthest depth stored in every 8x8 block and every tile, as a float
+		//whatever the format, rounded up so a depth that would pass the test in the buffer never fails here
+		std::vector<float> m_BlockMaxDepth{};
+		//Lazy clear: a block's depth and color are only reset the first time a triangle reaches it. Blocks that are
+		//never reached keep their flag, read as empty and resolve straight to the clear color
+		std::vector<uint8_t> m_BlockNeedsClear{};
+		uint32_t m_ClearColor{};
+		std::vector<float> m_TileMaxDepth{};
+		ThreadPool* m_pThreadPool{ nullptr };
+		//Triangles are clipped against the near plane only, anything up to this many NDC units away is rasterized as is
+		const float m_GuardBand{ 4.f };
+		//One float per vertex per component, so the transform can load and store 4 vertices at a time
+		struct VertexStream3
+		{
+			std::vector<float> x{};
+			std::vector<float> y{};
+			std::vector<float> z{};
+		};
+
+		//Structure of arrays version of a mesh's vertices, every stream is padded to a multiple of 4 vertices.
+		//The model space streams are filled once when the mesh is loaded, the rest is overwritten every frame
+		struct MeshVertexStreams
+		{
+			VertexStream3 position{};
+			VertexStream3 normal{};
+			VertexStream3 tangent{};
+			std::vector<float> u{};
+			std::vector<float> v{};
+
+			std::vector<float> clipX{};
+			std::vector<float> clipY{};
+			std::vector<float> clipZ{};
+			std::vector<float> clipW{};
+			VertexStream3 worldNormal{};
+			VertexStream3 worldTangent{};
+			VertexStream3 viewDirection{};
+
+			Vertex_Out_Rasterizer GetVertex(uint32_t index) const;
+		};
+
+		std::vector<MeshVertexStreams> m_MeshVertexStreams{};
+
+		//Front to back ordering: every mesh is split into runs of consecutive triangles once, and each frame the meshes
+		//and the runs within them are submitted nearest first, so far geometry mostly hits a filled depth buffer
+		bool m_UseFrontToBackOrder{ true };
+		const uint32_t m_TrianglesPerCluster{ 64 };
+		struct TriangleCluster
+		{
+			uint32_t firstTriangle{};
+			uint32_t nrTriangles{};
+			//Middle of the cluster's bounding box in model space
+			Vector3 center{};
+		};
+		std::vector<std::vector<TriangleCluster>> m_MeshClusters{};
+		struct ClusterToDraw
+		{
+			float meshDepth{};
+			float depth{};
+			uint32_t meshIndex{};
+			uint32_t clusterIndex{};
+		};
+		std::vector<ClusterToDraw> m_DrawOrder{};
+		//Vertices per job when the transform is spread over the thread pool
+		const int m_TransformChunkSize{ 1024 };
+
+		//Everything triangle setup produces for one frame
+		struct FrameSetup
+		{
+			std::vector<TriangleToRaster> triangles{};
+			std::vector<TriangleAttributes> triangleAttributes{};
+			//Indices into triangles per tile, kept in submission order so every pixel sees the same draw order as a serial pass
+			std::vector<std::vector<uint32_t>> tileBins{};
+			int nrTrianglesCulled{};
+			//The settings the setup depends on. A frame set up for other ones is set up again before it is rasterized
+			int renderWidth{};
+			int renderHeight{};
+			bool useMsaa{};
+			bool isReady{ false };
+		};
+
+		//Pipelining: while the tiles of one frame are rasterized, one job sets up the next frame in the other
+		//FrameSetup. What ends up on screen was set up a frame earlier, in exchange the two stages overlap
+		bool m_UsePipelining{ false };
+		FrameSetup m_FrameSetups[2]{};
+		int m_RasterFrameIndex{};
+
+		//Where pixel (px, py) lives in the depth, color and visibility buffers. Blocks are 8x8, so shifts do
+		int PixelIndex(int px, int py) const
+		{
+			if (m_UseTiledLayout)
+			{
+				return (((py >> 3) * m_NrBlocksX + (px >> 3)) << 6) + ((py & 7) << 3) + (px & 7);
+			}
+			return px + py * m_NrBlocksX * m_BlockSize;
+		}
+
+		//Function that transforms the vertices from the mesh from World space to Clip space
+		void VertexTransformationFunction(const std::vector<Mesh*>& meshes, std::vector<MeshVertexStreams>& meshVertices_out, bool isParallel) const; //W1 Version
+		void CreateVertexStreams(const Mesh* mesh, MeshVertexStreams& streams) const;
 		void OptimiseWithTriangleStrip(std::vector<Uint32>& indices);
-		void RenderTriangle(const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2, bool success, const SDL_Rect& boundaries);
+		void SetRenderResolution(int width, int height);
+		void UpdateResolutionScale(float frameTime);
+		void CreateTriangleClusters(const Mesh* mesh, const MeshVertexStreams& streams, std::vector<TriangleCluster>& clusters) const;
+		void SortDrawOrder();
+		bool SetupTriangle(const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2, TriangleToRaster& triangle, TriangleAttributes& attributes) const;
+		struct RasterStatistics
+		{
+			int nrFragmentsPassed{};
+			int nrFragmentsRejected{};
+			int nrBlocksRejected{};
+		};
+		void RenderTriangle(const TriangleToRaster& triangle, const TriangleAttributes& attributes, uint32_t triangleIndex, const SDL_Rect& boundaries, RasterStatistics& statistics);
+		int ShadeVisibilityBuffer(const FrameSetup& frame, int tileIndex);
+		void ClearBlockIfNeeded(int blockX, int blockY);
+		__m128 TestAndWriteDepth(int pixelIndex, int nrLanes, __m128 lerpZ, __m128 mask);
+		void UpdateBlockMaxDepth(int blockX, int blockY);
+		void UpdateTileMaxDepth(int tileIndex);
+		uint32_t MapRGB(uint8_t r, uint8_t g, uint8_t b) const;
+		uint32_t PackColor(const ColorRGB& color) const;
+		uint32_t ShadePixel(const TriangleToRaster& triangle, const TriangleAttributes& attributes, int px, int py, float lerpZ);
+		void SetupFrame(FrameSetup& frame, bool isParallel);
+		void AddMeshTriangle(FrameSetup& frame, const Mesh* mesh, const MeshVertexStreams& streams, uint32_t triangleNumber) const;
+		void AddTriangle(FrameSetup& frame, const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2) const;
+		void AddScreenTriangle(FrameSetup& frame, const Vertex_Out_Rasterizer& v0, const Vertex_Out_Rasterizer& v1, const Vertex_Out_Rasterizer& v2) const;
+		void BinTriangles(FrameSetup& frame) const;
+		void RenderTile(const FrameSetup& frame, int tileIndex);
+		void ResolveTile(int tileIndex);
 		void RenderMeshes();
-		ColorRGB PixelShading(const Vertex_Out_Rasterizer& v);
-		ColorRGB Diffuse(const Vector2& uv, float observedArea);
-		ColorRGB Specular(const Vertex_Out_Rasterizer& v, const Vector3& vectorNormal, const Vector3& lightDirection);
+		ColorRGB PixelShading(const Vertex_Out_Rasterizer& v, const Vector2& uvDx, const Vector2& uvDy);
+		ColorRGB Diffuse(const ColorRGB& lightColor, float observedArea);
+		ColorRGB Specular(const Vertex_Out_Rasterizer& v, const ColorRGB& sampledSpecularColor, const ColorRGB& phongExponent, const Vector3& vectorNormal, const Vector3& lightDirection);
 		void Remap(float& depth, const float min, const float max);
-		bool CanRenderTriangle(const Vector3& v1, const Vector3& v2, const Vector3& viewDir);
 
 	};
 }
@@ -1,11 +1,292 @@
 #include "pch.h"
 #include "Texture.h"
+#include <climits>
 namespace dae
 {
+	std::atomic<uint32_t> Texture::m_NrCompressedTextures{};
+
+	//Block compression, every block is 16 texels in row order. Endpoints are the block's bounding box, every texel picks the
+	//closest palette entry. Far from the best possible encoder, but it runs once at load and keeps up with the decoder
+	static uint16_t PackRGB565(uint32_t texel)
+	{
+		return static_cast<uint16_t>(((texel & 0xF8) << 8) | ((texel >> 5) & 0x7E0) | ((texel >> 19) & 0x1F));
+	}
+
+	static uint32_t UnpackRGB565(uint16_t color)
+	{
+		const uint32_t red{ static_cast<uint32_t>(color >> 11) };
+		const uint32_t green{ static_cast<uint32_t>((color >> 5) & 0x3F) };
+		const uint32_t blue{ static_cast<uint32_t>(color & 0x1F) };
+		return ((red << 3) | (red >> 2)) | (((green << 2) | (green >> 4)) << 8) | (((blue << 3) | (blue >> 2)) << 16) | 0xFF000000;
+	}
+
+	static void GetBC1Palette(uint16_t color0, uint16_t color1, bool isFourColors, uint32_t palette[4])
+	{
+		palette[0] = UnpackRGB565(color0);
+		palette[1] = UnpackRGB565(color1);
+		palette[2] = 0xFF000000;
+		palette[3] = isFourColors ? 0xFF000000 : 0;
+		for (int shift{}; shift < 24; shift += 8)
+		{
+			const uint32_t channel0{ (palette[0] >> shift) & 0xFF };
+			const uint32_t channel1{ (palette[1] >> shift) & 0xFF };
+			if (isFourColors)
+			{
+				palette[2] |= ((2 * channel0 + channel1 + 1) / 3) << shift;
+				palette[3] |= ((channel0 + 2 * channel1 + 1) / 3) << shift;
+			}
+			else
+			{
+				palette[2] |= ((channel0 + channel1) / 2) << shift;
+			}
+		}
+	}
+
+	static void GetBC4Palette(uint32_t value0, uint32_t value1, uint32_t palette[8])
+	{
+		palette[0] = value0;
+		palette[1] = value1;
+		if (value0 > value1)
+		{
+			for (uint32_t index{ 2 }; index < 8; ++index)
+			{
+				palette[index] = ((8 - index) * value0 + (index - 1) * value1 + 3) / 7;
+			}
+			return;
+		}
+		for (uint32_t index{ 2 }; index < 6; ++index)
+		{
+			palette[index] = ((6 - index) * value0 + (index - 1) * value1 + 2) / 5;
+		}
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+
+	static uint64_t EncodeBC1(const uint32_t texels[16])
+	{
+		uint32_t minChannels[3]{ 255, 255, 255 };
+		uint32_t maxChannels[3]{};
+		for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+		{
+			for (int channel{}; channel < 3; ++channel)
+			{
+				const uint32_t value{ (texels[texelIndex] >> (channel * 8)) & 0xFF };
+				minChannels[channel] = std::min(minChannels[channel], value);
+				maxChannels[channel] = std::max(maxChannels[channel], value);
+			}
+		}
+
+		//Pull the endpoints in a little, the extremes are usually single outliers
+		uint32_t maxColor{};
+		uint32_t minColor{};
+		for (int channel{}; channel < 3; ++channel)
+		{
+			const uint32_t inset{ (maxChannels[channel] - minChannels[channel]) >> 4 };
+			maxColor |= (maxChannels[channel] - inset) << (channel * 8);
+			minColor |= (minChannels[channel] + inset) << (channel * 8);
+		}
+
+		//Every channel of maxColor is at least that of minColor, so color0 >= color1 and the block decodes with 4 colors
+		const uint16_t color0{ PackRGB565(maxColor) };
+		const uint16_t color1{ PackRGB565(minColor) };
+		uint64_t block{ color0 | (static_cast<uint64_t>(color1) << 16) };
+		if (color0 == color1)
+		{
+			return block;
+		}
+
+		uint32_t palette[4]{};
+		GetBC1Palette(color0, color1, true, palette);
+		for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+		{
+			int bestIndex{};
+			int bestDistance{ INT_MAX };
+			for (int paletteIndex{}; paletteIndex < 4; ++paletteIndex)
+			{
+				int distance{};
+				for (int shift{}; shift < 24; shift += 8)
+				{
+					const int difference{ static_cast<int>((texels[texelIndex] >> shift) & 0xFF) - static_cast<int>((palette[paletteIndex] >> shift) & 0xFF) };
+					distance += difference * difference;
+				}
+				if (distance < bestDistance)
+				{
+					bestDistance = distance;
+					bestIndex = paletteIndex;
+				}
+			}
+			block |= static_cast<uint64_t>(bestIndex) << (32 + 2 * texelIndex);
+		}
+		return block;
+	}
+
+	//One channel of the texels (the byte at shift), BC3 uses it for alpha and BC5 for red and green
+	static uint64_t EncodeBC4(const uint32_t texels[16], int shift)
+	{
+		uint32_t minValue{ 255 };
+		uint32_t maxValue{};
+		for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+		{
+			const uint32_t value{ (texels[texelIndex] >> shift) & 0xFF };
+			minValue = std::min(minValue, value);
+			maxValue = std::max(maxValue, value);
+		}
+
+		uint64_t block{ maxValue | (minValue << 8) };
+		if (maxValue == minValue)
+		{
+			return block;
+		}
+
+		uint32_t palette[8]{};
+		GetBC4Palette(maxValue, minValue, palette);
+		for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+		{
+			const int value{ static_cast<int>((texels[texelIndex] >> shift) & 0xFF) };
+			int bestIndex{};
+			int bestDistance{ INT_MAX };
+			for (int paletteIndex{}; paletteIndex < 8; ++paletteIndex)
+			{
+				const int distance{ std::abs(value - static_cast<int>(palette[paletteIndex])) };
+				if (distance < bestDistance)
+				{
+					bestDistance = distance;
+					bestIndex = paletteIndex;
+				}
+			}
+			block |= static_cast<uint64_t>(bestIndex) << (16 + 3 * texelIndex);
+		}
+		return block;
+	}
+
+	static void DecodeBC1(uint64_t block, bool isAlwaysFourColors, uint32_t texels[16])
+	{
+		const uint16_t color0{ static_cast<uint16_t>(block & 0xFFFF) };
+		const uint16_t color1{ static_cast<uint16_t>((block >> 16) & 0xFFFF) };
+		uint32_t palette[4]{};
+		GetBC1Palette(color0, color1, isAlwaysFourColors || color0 > color1, palette);
+		for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+		{
+			texels[texelIndex] = palette[(block >> (32 + 2 * texelIndex)) & 3];
+		}
+	}
+
+	static void DecodeBC4(uint64_t block, uint8_t values[16])
+	{
+		uint32_t palette[8]{};
+		GetBC4Palette(static_cast<uint32_t>(block & 0xFF), static_cast<uint32_t>((block >> 8) & 0xFF), palette);
+		for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+		{
+			values[texelIndex] = static_cast<uint8_t>(palette[(block >> (16 + 3 * texelIndex)) & 7]);
+		}
+	}
+
+	static void DecodeBlock(Texture::Compression compression, const uint64_t* pBlock, uint32_t texels[16])
+	{
+		switch (compression)
+		{
+		case Texture::Compression::BC1:
+			DecodeBC1(pBlock[0], false, texels);
+			break;
+		case Texture::Compression::BC3:
+		{
+			//The alpha block comes first, the color block after it always has 4 colors
+			uint8_t alphas[16]{};
+			DecodeBC4(pBlock[0], alphas);
+			DecodeBC1(pBlock[1], true, texels);
+			for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+			{
+				texels[texelIndex] = (texels[texelIndex] & 0x00FFFFFF) | (static_cast<uint32_t>(alphas[texelIndex]) << 24);
+			}
+			break;
+		}
+		case Texture::Compression::BC5:
+		{
+			//Red and green hold x and y of a normal mapped from [-1, 1] to [0, 255], z follows from it being unit length
+			uint8_t reds[16]{};
+			uint8_t greens[16]{};
+			DecodeBC4(pBlock[0], reds);
+			DecodeBC4(pBlock[1], greens);
+			for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+			{
+				const float x{ static_cast<float>(reds[texelIndex]) / 127.5f - 1.f };
+				const float y{ static_cast<float>(greens[texelIndex]) / 127.5f - 1.f };
+				const float z{ std::sqrt(std::max(0.f, 1.f - x * x - y * y)) };
+				const uint32_t blue{ static_cast<uint32_t>((z + 1.f) * 127.5f + .5f) };
+				texels[texelIndex] = reds[texelIndex] | (greens[texelIndex] << 8) | (blue << 16) | 0xFF000000;
+			}
+			break;
+		}
+		case Texture::Compression::None:
+		default:
+			break;
+		}
+	}
+
 	Texture::Texture(SDL_Surface* pSurface) :
-		m_pSurface{pSurface},
-		m_pSurfacePixels {(uint32_t*)pSurface->pixels}
+		m_pSurface{pSurface}
+	{
+		DecodeSurface();
+	}
+	void Texture::DecodeSurface()
 	{
+		//Whatever format IMG_Load came up with, SDL_GetRGB runs once per texel here instead of on every Sample
+		const uint32_t* pSurfacePixels{ static_cast<const uint32_t*>(m_pSurface->pixels) };
+		const int surfaceWidth{ m_pSurface->pitch / static_cast<int>(sizeof(uint32_t)) };
+		m_MipLevels.clear();
+		MipLevel level{ {}, m_pSurface->w, m_pSurface->h, (m_pSurface->w + 3) / 4 };
+		level.texels.resize(static_cast<size_t>(level.nrBlocksX) * ((level.height + 3) / 4) * 16);
+		for (int y{}; y < level.height; ++y)
+		{
+			for (int x{}; x < level.width; ++x)
+			{
+				Uint8 colorR{};
+				Uint8 colorG{};
+				Uint8 colorB{};
+				SDL_GetRGB(pSurfacePixels[x + y * surfaceWidth], m_pSurface->format, &colorR, &colorG, &colorB);
+				level.texels[TexelIndex(level, x, y)] = colorR | (colorG << 8) | (colorB << 16) | 0xFF000000;
+			}
+		}
+		m_MipLevels.push_back(std::move(level));
+		BuildMipChain();
+	}
+
+	void Texture::BuildMipChain()
+	{
+		while (m_MipLevels.back().width > 1 || m_MipLevels.back().height > 1)
+		{
+			const MipLevel& source{ m_MipLevels.back() };
+			MipLevel level{ {}, std::max(source.width / 2, 1), std::max(source.height / 2, 1) };
+			level.nrBlocksX = (level.width + 3) / 4;
+			level.texels.resize(static_cast<size_t>(level.nrBlocksX) * ((level.height + 3) / 4) * 16);
+			for (int y{}; y < level.height; ++y)
+			{
+				//An odd row or column at the end gets dropped, a side that is already 1 texel averages that texel with itself
+				const int sourceY0{ std::min(2 * y, source.height - 1) };
+				const int sourceY1{ std::min(2 * y + 1, source.height - 1) };
+				for (int x{}; x < level.width; ++x)
+				{
+					const int sourceX0{ std::min(2 * x, source.width - 1) };
+					const int sourceX1{ std::min(2 * x + 1, source.width - 1) };
+					const uint32_t texels[4]{ source.texels[TexelIndex(source, sourceX0, sourceY0)], source.texels[TexelIndex(source, sourceX1, sourceY0)],
+						source.texels[TexelIndex(source, sourceX0, sourceY1)], source.texels[TexelIndex(source, sourceX1, sourceY1)] };
+
+					uint32_t average{};
+					for (int shift{}; shift < 32; shift += 8)
+					{
+						uint32_t sum{ 2 };
+						for (const uint32_t texel : texels)
+						{
+							sum += (texel >> shift) & 0xFF;
+						}
+						average |= (sum / 4) << shift;
+					}
+					level.texels[TexelIndex(level, x, y)] = average;
+				}
+			}
+			//push_back may move the levels around, source isn't used after this
+			m_MipLevels.push_back(std::move(level));
+		}
 	}
 
 	Texture::~Texture()
@@ -37,6 +318,140 @@ namespace dae
 		return new Texture{ new SDL_Surface{ image->flags, image->format, image->w, image->h, image->pitch,image->pixels,  image->userdata, image->locked,image->lock_data,image->clip_rect,image->map,image->refcount }};
 	}
 
+	Texture* Texture::CreateInterleaved(const std::vector<const Texture*>& pLayerTextures)
+	{
+		//Each texel of the result holds the texel of every layer texture side by side, in the order they were passed in.
+		//The mip chains are copied level by level, so all layers need the same size
+		const Texture* pFirstTexture{ pLayerTextures.front() };
+		const int nrLayers{ static_cast<int>(pLayerTextures.size()) };
+		if (nrLayers > m_MaxNrLayers)
+		{
+			return nullptr;
+		}
+		for (const Texture* pLayerTexture : pLayerTextures)
+		{
+			const MipLevel& layerLevel{ pLayerTexture->m_MipLevels.front() };
+			if (pLayerTexture->m_NrLayers != 1 || pLayerTexture->m_Compression != Compression::None || layerLevel.width != pFirstTexture->GetWidth() || layerLevel.height != pFirstTexture->m_MipLevels.front().height)
+			{
+				return nullptr;
+			}
+		}
+
+		Texture* pTexture{ new Texture{ nrLayers } };
+		for (size_t levelIndex{}; levelIndex < pFirstTexture->m_MipLevels.size(); ++levelIndex)
+		{
+			const MipLevel& firstLevel{ pFirstTexture->m_MipLevels[levelIndex] };
+			MipLevel level{ {}, firstLevel.width, firstLevel.height, firstLevel.nrBlocksX };
+			level.texels.resize(firstLevel.texels.size() * nrLayers);
+			for (int y{}; y < level.height; ++y)
+			{
+				for (int x{}; x < level.width; ++x)
+				{
+					const int texelIndex{ pTexture->TexelIndex(level, x, y) * nrLayers };
+					for (int layer{}; layer < nrLayers; ++layer)
+					{
+						const Texture* pLayerTexture{ pLayerTextures[layer] };
+						const MipLevel& layerLevel{ pLayerTexture->m_MipLevels[levelIndex] };
+						level.texels[texelIndex + layer] = layerLevel.texels[pLayerTexture->TexelIndex(layerLevel, x, y)];
+					}
+				}
+			}
+			pTexture->m_MipLevels.push_back(std::move(level));
+		}
+		return pTexture;
+	}
+
+	Texture* Texture::CreateCompressed(const Texture* pSource, Compression compression)
+	{
+		if (compression == Compression::None || pSource->m_NrLayers != 1 || pSource->m_Compression != Compression::None)
+		{
+			return nullptr;
+		}
+
+		Texture* pTexture{ new Texture{ 1 } };
+		pTexture->m_Compression = compression;
+		pTexture->m_NrBlockWords = compression == Compression::BC1 ? 1 : 2;
+		pTexture->m_CompressedId = ++m_NrCompressedTextures;
+		for (const MipLevel& sourceLevel : pSource->m_MipLevels)
+		{
+			MipLevel level{ {}, sourceLevel.width, sourceLevel.height, sourceLevel.nrBlocksX };
+			const int nrBlocksY{ (level.height + 3) / 4 };
+			level.blocks.resize(static_cast<size_t>(level.nrBlocksX) * nrBlocksY * pTexture->m_NrBlockWords);
+			for (int blockY{}; blockY < nrBlocksY; ++blockY)
+			{
+				for (int blockX{}; blockX < level.nrBlocksX; ++blockX)
+				{
+					//Blocks sticking out past the edge of a small level repeat its last row and column
+					uint32_t texels[16]{};
+					for (int texelIndex{}; texelIndex < 16; ++texelIndex)
+					{
+						const int x{ std::min(blockX * 4 + (texelIndex & 3), level.width - 1) };
+						const int y{ std::min(blockY * 4 + (texelIndex >> 2), level.height - 1) };
+						texels[texelIndex] = sourceLevel.texels[pSource->TexelIndex(sourceLevel, x, y)];
+					}
+
+					uint64_t* pBlock{ &level.blocks[(blockX + blockY * level.nrBlocksX) * pTexture->m_NrBlockWords] };
+					switch (compression)
+					{
+					case Compression::BC1:
+						pBlock[0] = EncodeBC1(texels);
+						break;
+					case Compression::BC3:
+						pBlock[0] = EncodeBC4(texels, 24);
+						pBlock[1] = EncodeBC1(texels);
+						break;
+					case Compression::BC5:
+						pBlock[0] = EncodeBC4(texels, 0);
+						pBlock[1] = EncodeBC4(texels, 8);
+						break;
+					case Compression::None:
+					default:
+						break;
+					}
+				}
+			}
+			pTexture->m_MipLevels.push_back(std::move(level));
+		}
+		return pTexture;
+	}
+
+	void Texture::SetCompression(Compression compression)
+	{
+		//Only textures loaded from a surface can get their texels back
+		if (compression == m_Compression || m_pSurface == nullptr || m_NrLayers != 1)
+		{
+			return;
+		}
+
+		if (m_Compression != Compression::None)
+		{
+			//Decoded in the texel layout that was active before compressing
+			DecodeSurface();
+			m_Compression = Compression::None;
+			m_NrBlockWords = 0;
+			m_CompressedId = 0;
+		}
+		if (compression != Compression::None)
+		{
+			//The copy ends up with the decoded levels and takes them along when it's deleted
+			Texture* pCompressed{ CreateCompressed(this, compression) };
+			m_MipLevels.swap(pCompressed->m_MipLevels);
+			m_Compression = pCompressed->m_Compression;
+			m_NrBlockWords = pCompressed->m_NrBlockWords;
+			m_CompressedId = pCompressed->m_CompressedId;
+			delete pCompressed;
+		}
+	}
+	size_t Texture::GetNrTexelBytes() const
+	{
+		size_t nrBytes{};
+		for (const MipLevel& level : m_MipLevels)
+		{
+			nrBytes += level.texels.size() * sizeof(uint32_t) + level.blocks.size() * sizeof(uint64_t);
+		}
+		return nrBytes;
+	}
+
 	void Texture::SetSRV(ID3D11Device* pDevice)
 	{
 		DXGI_FORMAT format = DXGI_FORMAT_R8G8B8A8_UNORM;
@@ -82,26 +497,208 @@ namespace dae
 		}
 	}
 
-	ColorRGB Texture::Sample(const Vector2& uv) const
+	void Texture::SetTexelLayout(TexelLayout texelLayout)
 	{
-		//TODO
-		//Sample the correct texel for the given uv
-		const Vector2 uvToWidthHeight{ m_pSurface->w * uv.x , m_pSurface->h * uv.y };
-		const Uint32 pixelIndex{ static_cast<Uint32>(uvToWidthHeight.x) + (static_cast<Uint32>(m_pSurface->w) * static_cast<Uint32>(uvToWidthHeight.y)) };
-		try
+		//Compressed blocks are 4x4 blocks already
+		if (texelLayout == m_TexelLayout || m_Compression != Compression::None)
 		{
-			const Uint32 pixel{ m_pSurfacePixels[pixelIndex] };
-			Uint8 colorR{};
-			Uint8 colorG{};
-			Uint8 colorB{};
-			SDL_GetRGB(pixel, m_pSurface->format, &colorR, &colorG, &colorB);
-			const float colorRGBtoOne{ 1.f / 255.f };
-			ColorRGB color{ colorRGBtoOne * static_cast<float>(colorR),   colorRGBtoOne * static_cast<float>(colorG),   colorRGBtoOne * static_cast<float>(colorB) };
-			return color;
+			return;
+		}
+
+		//Read every texel through the old layout and write it through the new one, the padding stays unused in both
+		for (MipLevel& level : m_MipLevels)
+		{
+			std::vector<uint32_t> texels(level.texels.size());
+			for (int y{}; y < level.height; ++y)
+			{
+				for (int x{}; x < level.width; ++x)
+				{
+					const int from{ TexelIndex(level, x, y) * m_NrLayers };
+					const int to{ TexelIndex(level, texelLayout, x, y) * m_NrLayers };
+					std::copy_n(level.texels.begin() + from, m_NrLayers, texels.begin() + to);
+				}
+			}
+			level.texels.swap(texels);
+		}
+		m_TexelLayout = texelLayout;
+	}
+
+	void Texture::ApplyAddressMode(float& u, float& v) const
+	{
+		//Bring uv into [0, 1] first, then every texel index is in range without checking it
+		switch (m_AddressMode)
+		{
+		case AddressMode::Wrap:
+			u -= std::floor(u);
+			v -= std::floor(v);
+			break;
+		case AddressMode::Clamp:
+			u = std::min(std::max(u, 0.f), 1.f);
+			v = std::min(std::max(v, 0.f), 1.f);
+			break;
+		}
+	}
+
+	int Texture::AddressTexel(int texel, int size) const
+	{
+		//Bilinear footprints reach at most one texel past either side of a uv in [0, 1]
+		switch (m_AddressMode)
+		{
+		case AddressMode::Wrap:
+			if (texel < 0)
+			{
+				return texel + size;
+			}
+			return texel >= size ? texel - size : texel;
+		case AddressMode::Clamp:
+		default:
+			return std::min(std::max(texel, 0), size - 1);
 		}
-		catch (...)
+	}
+
+	void Texture::FetchTexel(const MipLevel& level, int x, int y, int nrLayers, uint32_t* pTexel_out) const
+	{
+		if (m_Compression != Compression::None)
 		{
-			return {};
+			pTexel_out[0] = FetchCompressedTexel(level, x, y);
+			return;
 		}
+		std::copy_n(&level.texels[TexelIndex(level, x, y) * m_NrLayers], nrLayers, pTexel_out);
+	}
+
+	uint32_t Texture::FetchCompressedTexel(const MipLevel& level, int x, int y) const
+	{
+		//Direct mapped on the block's address, the top 8 bits of a multiplicative hash pick one of the 256 entries. Every
+		//thread has its own, so the tile workers never wait on each other, and a miss decodes the whole block
+		thread_local DecodedBlock decodedBlocks[m_NrDecodedBlocks]{};
+		const int blockIndex{ (y >> 2) * level.nrBlocksX + (x >> 2) };
+		const uint64_t* pBlock{ &level.blocks[blockIndex * m_NrBlockWords] };
+		const uint32_t hash{ static_cast<uint32_t>(reinterpret_cast<uintptr_t>(pBlock) >> 3) * 2654435761u };
+		DecodedBlock& decodedBlock{ decodedBlocks[hash >> 24] };
+		if (decodedBlock.pBlock != pBlock || decodedBlock.compressedId != m_CompressedId)
+		{
+			DecodeBlock(m_Compression, pBlock, decodedBlock.texels);
+			decodedBlock.pBlock = pBlock;
+			decodedBlock.compressedId = m_CompressedId;
+		}
+		return decodedBlock.texels[((y & 3) << 2) + (x & 3)];
+	}
+
+	void Texture::SamplePoint(const MipLevel& level, float u, float v, int nrLayers, ColorRGB* pColors_out) const
+	{
+		//A coordinate of exactly 1 would land one past the last texel
+		const int texelX{ std::min(static_cast<int>(u * static_cast<float>(level.width)), level.width - 1) };
+		const int texelY{ std::min(static_cast<int>(v * static_cast<float>(level.height)), level.height - 1) };
+		uint32_t layerTexels[m_MaxNrLayers]{};
+		FetchTexel(level, texelX, texelY, nrLayers, layerTexels);
+
+		const float colorRGBtoOne{ 1.f / 255.f };
+		for (int layer{}; layer < nrLayers; ++layer)
+		{
+			const uint32_t texel{ layerTexels[layer] };
+			pColors_out[layer] = ColorRGB{ colorRGBtoOne * static_cast<float>(texel & 0xFF), colorRGBtoOne * static_cast<float>((texel >> 8) & 0xFF), colorRGBtoOne * static_cast<float>((texel >> 16) & 0xFF) };
+		}
+	}
+
+	void Texture::SampleBilinear(const MipLevel& level, float u, float v, int nrLayers, ColorRGB* pColors_out) const
+	{
+		//Texel centers sit at half coordinates, so the 4 nearest ones start half a texel up and left of uv
+		const float texelX{ u * static_cast<float>(level.width) - .5f };
+		const float texelY{ v * static_cast<float>(level.height) - .5f };
+		const float floorX{ std::floor(texelX) };
+		const float floorY{ std::floor(texelY) };
+		const float weightX{ texelX - floorX };
+		const float weightY{ texelY - floorY };
+
+		const int x0{ AddressTexel(static_cast<int>(floorX), level.width) };
+		const int x1{ AddressTexel(static_cast<int>(floorX) + 1, level.width) };
+		const int y0{ AddressTexel(static_cast<int>(floorY), level.height) };
+		const int y1{ AddressTexel(static_cast<int>(floorY) + 1, level.height) };
+		uint32_t layerTexels[4][m_MaxNrLayers]{};
+		FetchTexel(level, x0, y0, nrLayers, layerTexels[0]);
+		FetchTexel(level, x1, y0, nrLayers, layerTexels[1]);
+		FetchTexel(level, x0, y1, nrLayers, layerTexels[2]);
+		FetchTexel(level, x1, y1, nrLayers, layerTexels[3]);
+		const float weights[4]{ (1.f - weightX) * (1.f - weightY), weightX * (1.f - weightY), (1.f - weightX) * weightY, weightX * weightY };
+
+		const float colorRGBtoOne{ 1.f / 255.f };
+		for (int layer{}; layer < nrLayers; ++layer)
+		{
+			float color[3]{};
+			for (int texelIndex{}; texelIndex < 4; ++texelIndex)
+			{
+				const uint32_t texel{ layerTexels[texelIndex][layer] };
+				color[0] += weights[texelIndex] * static_cast<float>(texel & 0xFF);
+				color[1] += weights[texelIndex] * static_cast<float>((texel >> 8) & 0xFF);
+				color[2] += weights[texelIndex] * static_cast<float>((texel >> 16) & 0xFF);
+			}
+			pColors_out[layer] = ColorRGB{ colorRGBtoOne * color[0], colorRGBtoOne * color[1], colorRGBtoOne * color[2] };
+		}
+	}
+
+	void Texture::SampleFiltered(const Vector2& uv, const Vector2& uvDx, const Vector2& uvDy, FilterMode filterMode, int nrLayers, ColorRGB* pColors_out) const
+	{
+		float u{ uv.x };
+		float v{ uv.y };
+		ApplyAddressMode(u, v);
+
+		if (filterMode == FilterMode::Point)
+		{
+			SamplePoint(m_MipLevels.front(), u, v, nrLayers, pColors_out);
+			return;
+		}
+
+		//The level where one screen pixel steps about one texel: log2 of the longest footprint axis, measured in level 0 texels
+		const float width{ static_cast<float>(m_MipLevels.front().width) };
+		const float height{ static_cast<float>(m_MipLevels.front().height) };
+		const float lengthSqrX{ uvDx.x * uvDx.x * width * width + uvDx.y * uvDx.y * height * height };
+		const float lengthSqrY{ uvDy.x * uvDy.x * width * width + uvDy.y * uvDy.y * height * height };
+		const float maxLod{ static_cast<float>(m_MipLevels.size() - 1) };
+		//Written so a NaN footprint ends up at level 0
+		const float lod{ std::min(maxLod, std::max(0.f, .5f * std::log2(std::max(lengthSqrX, lengthSqrY)))) };
+
+		if (filterMode == FilterMode::Bilinear)
+		{
+			SampleBilinear(m_MipLevels[static_cast<size_t>(lod + .5f)], u, v, nrLayers, pColors_out);
+			return;
+		}
+
+		//Trilinear: blend the two levels around lod, most pixels on a magnified surface only need level 0
+		const size_t lowerLevel{ static_cast<size_t>(lod) };
+		const float weight{ lod - static_cast<float>(lowerLevel) };
+		SampleBilinear(m_MipLevels[lowerLevel], u, v, nrLayers, pColors_out);
+		if (weight <= 0.f)
+		{
+			return;
+		}
+		ColorRGB upperColors[m_MaxNrLayers]{};
+		SampleBilinear(m_MipLevels[lowerLevel + 1], u, v, nrLayers, upperColors);
+		for (int layer{}; layer < nrLayers; ++layer)
+		{
+			pColors_out[layer] = pColors_out[layer] * (1.f - weight) + upperColors[layer] * weight;
+		}
+	}
+
+	ColorRGB Texture::Sample(const Vector2& uv) const
+	{
+		float u{ uv.x };
+		float v{ uv.y };
+		ApplyAddressMode(u, v);
+
+		ColorRGB color{};
+		SamplePoint(m_MipLevels.front(), u, v, 1, &color);
+		return color;
+	}
+
+	ColorRGB Texture::Sample(const Vector2& uv, const Vector2& uvDx, const Vector2& uvDy, FilterMode filterMode) const
+	{
+		ColorRGB color{};
+		SampleFiltered(uv, uvDx, uvDy, filterMode, 1, &color);
+		return color;
+	}
+
+	void Texture::SampleLayers(const Vector2& uv, const Vector2& uvDx, const Vector2& uvDy, FilterMode filterMode, ColorRGB* pColors_out) const
+	{
+		SampleFiltered(uv, uvDx, uvDy, filterMode, m_NrLayers, pColors_out);
 	}
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
 #pragma once
+#include <atomic>
+
 namespace dae
 {
 	class Texture final
@@ -8,15 +10,123 @@ namespace dae
 		~Texture();
 
 		static Texture* LoadFromFile(const std::string& path);
+		//Software only texture that interleaves up to 4 textures of the same size, so one texel read serves all of them.
+		//Returns nullptr when the sizes don't match
+		static Texture* CreateInterleaved(const std::vector<const Texture*>& pLayerTextures);
+
+		//Block compression for the software sampler, every 4x4 block stored bit for bit like the D3D formats. BC1 is RGB in 8 bytes,
+		//BC3 adds 8 bytes of alpha and BC5 keeps only red and green in 16 bytes, blue is rebuilt as the z of a unit tangent space normal
+		enum class Compression
+		{
+			None,
+			BC1,
+			BC3,
+			BC5
+		};
+		//Software only copy of a texture (and its mip chain) in a block compressed format, 8 (BC1) or 4 (BC3, BC5) times smaller
+		static Texture* CreateCompressed(const Texture* pSource, Compression compression);
+		//Replaces the software texels of a loaded texture with blocks in the given format, so only one copy stays in memory.
+		//None decodes the surface again. The surface itself is left alone, the DirectX views are made from it
+		void SetCompression(Compression compression);
+		Compression GetCompression() const { return m_Compression; }
+		//Memory taken by the texels or blocks of every mip level
+		size_t GetNrTexelBytes() const;
 
 		//Gets the Shader Resource View
 		void SetSRV(ID3D11Device* pDevice);
 		ID3D11ShaderResourceView* GetSRV() const { return m_pSRV; }
+		//Point sample of the full resolution texture
 		ColorRGB Sample(const Vector2& uv) const;
+
+		enum class FilterMode
+		{
+			Point,
+			Bilinear,
+			Trilinear
+		};
+		//Filtered sample from the mip chain, the level follows from how far uv moves per screen pixel in x (uvDx) and y (uvDy)
+		ColorRGB Sample(const Vector2& uv, const Vector2& uvDx, const Vector2& uvDy, FilterMode filterMode) const;
+		//Same as the filtered Sample, for every layer of an interleaved texture at once, pColors_out needs room for GetNrLayers colors
+		void SampleLayers(const Vector2& uv, const Vector2& uvDx, const Vector2& uvDy, FilterMode filterMode, ColorRGB* pColors_out) const;
+		int GetNrLayers() const { return m_NrLayers; }
+
+		//What Sample does with uv outside [0, 1]: repeat the texture or stretch its border texels
+		enum class AddressMode
+		{
+			Wrap,
+			Clamp
+		};
+		void SetAddressMode(AddressMode addressMode) { m_AddressMode = addressMode; }
+
+		//How texels are ordered in memory: row by row, or as 4x4 blocks of one cache line each, block rows one after the other
+		enum class TexelLayout
+		{
+			Linear,
+			Blocked4x4
+		};
+		void SetTexelLayout(TexelLayout texelLayout);
+		TexelLayout GetTexelLayout() const { return m_TexelLayout; }
+		int GetWidth() const { return m_MipLevels.front().width; }
 	private:
+		explicit Texture(int nrLayers) : m_NrLayers{ nrLayers } {}
+
 		ID3D11Texture2D* m_pResource{nullptr};
 		ID3D11ShaderResourceView* m_pSRV{nullptr};
 		SDL_Surface* m_pSurface{nullptr};
-		uint32_t* m_pSurfacePixels{ nullptr };
+
+		//Compressed textures only fill MipLevel::blocks, 1 (BC1) or 2 uint64_t per block. The blocks are decoded as they are sampled,
+		//through a small cache per thread. The id tells cache entries of different textures apart
+		Compression m_Compression{ Compression::None };
+		int m_NrBlockWords{};
+		uint32_t m_CompressedId{};
+		static std::atomic<uint32_t> m_NrCompressedTextures;
+		struct DecodedBlock
+		{
+			uint32_t compressedId{};
+			const uint64_t* pBlock{ nullptr };
+			uint32_t texels[16]{};
+		};
+		static const int m_NrDecodedBlocks{ 256 };
+
+		//Layers per texel, each one uint32_t. Only interleaved textures have more than 1
+		static const int m_MaxNrLayers{ 4 };
+		int m_NrLayers{ 1 };
+
+		//The surface decoded once when loading, one texel per uint32_t with red in the lowest byte, then green, blue and alpha.
+		//Level 0 is the full surface, every next level halves it with a 2x2 box filter down to 1x1
+		struct MipLevel
+		{
+			std::vector<uint32_t> texels{};
+			int width{};
+			int height{};
+			//Blocks per row, levels are padded to whole 4x4 blocks so Blocked4x4 needs no edge cases
+			int nrBlocksX{};
+			std::vector<uint64_t> blocks{};
+		};
+		std::vector<MipLevel> m_MipLevels{};
+		AddressMode m_AddressMode{ AddressMode::Wrap };
+		TexelLayout m_TexelLayout{ TexelLayout::Linear };
+
+		//Where texel (x, y) of a level lives in its texels, same idea as RasterizerRenderer::PixelIndex
+		static int TexelIndex(const MipLevel& level, TexelLayout texelLayout, int x, int y)
+		{
+			if (texelLayout == TexelLayout::Blocked4x4)
+			{
+				return (((y >> 2) * level.nrBlocksX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+			}
+			return x + y * level.width;
+		}
+		int TexelIndex(const MipLevel& level, int x, int y) const { return TexelIndex(level, m_TexelLayout, x, y); }
+
+		void DecodeSurface();
+		void BuildMipChain();
+		void ApplyAddressMode(float& u, float& v) const;
+		int AddressTexel(int texel, int size) const;
+		//Copies the nrLayers words of texel (x, y), decoding its block first if the texture is compressed
+		void FetchTexel(const MipLevel& level, int x, int y, int nrLayers, uint32_t* pTexel_out) const;
+		uint32_t FetchCompressedTexel(const MipLevel& level, int x, int y) const;
+		void SamplePoint(const MipLevel& level, float u, float v, int nrLayers, ColorRGB* pColors_out) const;
+		void SampleBilinear(const MipLevel& level, float u, float v, int nrLayers, ColorRGB* pColors_out) const;
+		void SampleFiltered(const Vector2& uv, const Vector2& uvDx, const Vector2& uvDy, FilterMode filterMode, int nrLayers, ColorRGB* pColors_out) const;
 	};
 }
\ No newline at end of file
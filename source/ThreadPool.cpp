@@ -0,0 +1,97 @@
+#include "pch.h"
+#include "ThreadPool.h"
+
+namespace dae
+{
+	ThreadPool::ThreadPool(unsigned int nrThreads)
+	{
+		//hardware_concurrency is allowed to return 0 when it can't tell
+		const unsigned int nrWorkers{ nrThreads > 1 ? nrThreads - 1 : 0 };
+		m_Workers.reserve(nrWorkers);
+		for (unsigned int i{}; i < nrWorkers; ++i)
+		{
+			m_Workers.emplace_back(&ThreadPool::WorkerLoop, this);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			m_IsStopping = true;
+		}
+		m_WakeCondition.notify_all();
+
+		for (std::thread& worker : m_Workers)
+		{
+			worker.join();
+		}
+	}
+
+	void ThreadPool::ParallelFor(int count, const std::function<void(int)>& job)
+	{
+		if (count <= 0)
+		{
+			return;
+		}
+
+		if (m_Workers.empty() || count == 1)
+		{
+			for (int i{}; i < count; ++i)
+			{
+				job(i);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			m_pJob = &job;
+			m_JobCount = count;
+			m_NextIndex = 0;
+			m_NrBusyWorkers = static_cast<int>(m_Workers.size());
+			++m_Generation;
+		}
+		m_WakeCondition.notify_all();
+
+		RunJobs();
+
+		//Every worker checks in once per generation, so none of them can still be touching job after this
+		std::unique_lock<std::mutex> lock{ m_Mutex };
+		m_DoneCondition.wait(lock, [this] { return m_NrBusyWorkers == 0; });
+		m_pJob = nullptr;
+	}
+
+	void ThreadPool::WorkerLoop()
+	{
+		uint64_t lastGeneration{};
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock{ m_Mutex };
+				m_WakeCondition.wait(lock, [this, lastGeneration] { return m_IsStopping || m_Generation != lastGeneration; });
+				if (m_IsStopping)
+				{
+					return;
+				}
+				lastGeneration = m_Generation;
+			}
+
+			RunJobs();
+
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			if (--m_NrBusyWorkers == 0)
+			{
+				m_DoneCondition.notify_one();
+			}
+		}
+	}
+
+	void ThreadPool::RunJobs()
+	{
+		for (int index{ m_NextIndex++ }; index < m_JobCount; index = m_NextIndex++)
+		{
+			(*m_pJob)(index);
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+//Standard includes
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	class ThreadPool final
+	{
+	public:
+		//Spawns nrThreads - 1 workers, the thread calling ParallelFor is the last one
+		explicit ThreadPool(unsigned int nrThreads = std::thread::hardware_concurrency());
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		//Calls job(index) for every index in [0, count) and only returns once all of them are done
+		void ParallelFor(int count, const std::function<void(int)>& job);
+
+		unsigned int GetNrThreads() const { return static_cast<unsigned int>(m_Workers.size()) + 1; }
+
+	private:
+		void WorkerLoop();
+		void RunJobs();
+
+		std::vector<std::thread> m_Workers{};
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_WakeCondition{};
+		std::condition_variable m_DoneCondition{};
+
+		const std::function<void(int)>* m_pJob{ nullptr };
+		std::atomic<int> m_NextIndex{};
+		int m_JobCount{};
+		int m_NrBusyWorkers{};
+		uint64_t m_Generation{};
+		bool m_IsStopping{ false };
+	};
+}
@@ -46,7 +46,19 @@ void PrintKeyBindings(const int greenConsoleAttribute, const int yellowConsoleAt
 	std::cout << "   [F5] Cycle Shading Mode (COMBINED/OBSERVED_AREA/DIFFUSE/SPECULAR)\n";
 	std::cout << "   [F6] Toggle NormalMap (ON/OFF)\n";
 	std::cout << "   [F7] Toggle DepthBuffer Visualization (ON/OFF)\n";
-	std::cout << "   [F8] Toggle BoundingBox Visualization (ON/OFF)\n\n\n";
+	std::cout << "   [F8] Toggle BoundingBox Visualization (ON/OFF)\n";
+	std::cout << "   [1]  Toggle Visibility Buffer (ON/OFF)\n";
+	std::cout << "   [2]  Toggle Framebuffer Layout (8x8 BLOCKS/LINEAR)\n";
+	std::cout << "   [3]  Cycle Depth Format (FLOAT32/UNORM24_STENCIL8/UNORM16)\n";
+	std::cout << "   [4]  Toggle Front To Back Ordering\n";
+	std::cout << "   [5]  Toggle MSAA (OFF/4X)\n";
+	std::cout << "   [6]  Toggle Dynamic Resolution\n";
+	std::cout << "   [7]  Toggle Frame Pipelining\n";
+	std::cout << "   [8]  Cycle Texture Filter (POINT/BILINEAR/TRILINEAR)\n";
+	std::cout << "   [9]  Toggle Texel Layout (4x4 BLOCKS/LINEAR)\n";
+	std::cout << "   [0]  Benchmark Texture Sampling\n";
+	std::cout << "   [M]  Toggle Interleaved Material Texture (ON/OFF)\n";
+	std::cout << "   [C]  Toggle Block Compression (BC1/BC5, ON/OFF)\n\n\n";
 
 
 }
@@ -271,6 +283,66 @@ int main(int argc, char* args[])
 							std::cout << "OFF\n";
 						}
 					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_1)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleVisibilityBuffer();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_2)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleTiledLayout();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_3)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->CycleDepthFormat();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_4)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleFrontToBackOrder();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_5)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleMsaa();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_6)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleDynamicResolution();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_7)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->TogglePipelining();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_8)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->CycleTextureFilter();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_9)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleTexelLayout();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_0)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->BenchmarkTextureSampling();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_M)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleMaterialTexture();
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_C)
+					{
+						SetConsoleTextAttribute(hConsole, purpleConsoleAttribute);
+						pRasterizer->ToggleBlockCompression();
+					}
 				}
 #pragma endregion
 				break;
@@ -298,6 +370,10 @@ int main(int argc, char* args[])
 				SetConsoleTextAttribute(hConsole, greyColorAttribute);
 				printTimer = 0.f;
 				std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+				if (selectedMode == 0)
+				{
+					pRasterizer->PrintStatistics();
+				}
 			}
 		}
 	}